@@ -0,0 +1,122 @@
+/* (c) William Edwards, 2011
+   Using the Simplified BSD License.  See LICENSE file for details */
+
+#include "address.hpp"
+
+#include <arpa/inet.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+SocketAddress::SocketAddress(): len(0) {
+	memset(&addr,0,sizeof(addr));
+	spec[0] = '\0';
+}
+
+bool SocketAddress::parse_port(const char* s,in_port_t& port) {
+	char* end;
+	const long p = strtol(s,&end,10);
+	if(!*s || *end || (p < 0) || (p > 0xffff))
+		return false;
+	port = htons(p);
+	return true;
+}
+
+bool SocketAddress::parse(const char* s) {
+	memset(&addr,0,sizeof(addr));
+	len = 0;
+	if(strlen(s) >= sizeof(spec))
+		return false;
+	strcpy(spec,s);
+	if(!strncmp(s,"unix:",5)) {
+		sockaddr_un& un = reinterpret_cast<sockaddr_un&>(addr);
+		const char* path = s+5;
+		const size_t path_len = strlen(path);
+		if(!path_len || (path_len >= sizeof(un.sun_path)))
+			return false;
+		un.sun_family = AF_UNIX;
+		memcpy(un.sun_path,path,path_len);
+		if('@' == path[0]) {
+			un.sun_path[0] = '\0'; // abstract; the length says where the name ends
+			len = offsetof(sockaddr_un,sun_path) + path_len;
+		} else
+			len = sizeof(un);
+		return true;
+	}
+	if('[' == s[0]) {
+		const char* close = strchr(s,']');
+		char host[INET6_ADDRSTRLEN];
+		if(!close || (':' != close[1]) || ((size_t)(close-s-1) >= sizeof(host)))
+			return false;
+		memcpy(host,s+1,close-s-1);
+		host[close-s-1] = '\0';
+		sockaddr_in6& in6 = reinterpret_cast<sockaddr_in6&>(addr);
+		if(!parse_port(close+2,in6.sin6_port) || (1 != inet_pton(AF_INET6,host,&in6.sin6_addr)))
+			return false;
+		in6.sin6_family = AF_INET6;
+		len = sizeof(in6);
+		return true;
+	}
+	sockaddr_in& in = reinterpret_cast<sockaddr_in&>(addr);
+	const char* colon = strrchr(s,':');
+	const char* port = colon? colon+1: s;
+	if(!parse_port(port,in.sin_port))
+		return false;
+	in.sin_addr.s_addr = INADDR_ANY;
+	if(colon && (colon != s) && !((1 == colon-s) && ('*' == s[0]))) {
+		char host[INET_ADDRSTRLEN];
+		if((size_t)(colon-s) >= sizeof(host))
+			return false;
+		memcpy(host,s,colon-s);
+		host[colon-s] = '\0';
+		if(1 != inet_pton(AF_INET,host,&in.sin_addr))
+			return false;
+	}
+	in.sin_family = AF_INET;
+	len = sizeof(in);
+	return true;
+}
+
+bool SocketAddress::is_ipv6_any() const {
+	return (AF_INET6 == family()) &&
+		IN6_IS_ADDR_UNSPECIFIED(&reinterpret_cast<const sockaddr_in6&>(addr).sin6_addr);
+}
+
+const char* SocketAddress::get_path() const {
+	const sockaddr_un& un = reinterpret_cast<const sockaddr_un&>(addr);
+	return ((AF_UNIX == family()) && un.sun_path[0])? un.sun_path: NULL;
+}
+
+/*** IPAddress ***/
+
+static const uint8_t v4_mapped[12] = {0,0,0,0,0,0,0,0,0,0,0xff,0xff};
+
+bool IPAddress::set(const sockaddr* addr) {
+	switch(addr->sa_family) {
+	case AF_INET:
+		memcpy(bytes,v4_mapped,sizeof(v4_mapped));
+		memcpy(bytes+12,&reinterpret_cast<const sockaddr_in*>(addr)->sin_addr,4);
+		return true;
+	case AF_INET6:
+		memcpy(bytes,&reinterpret_cast<const sockaddr_in6*>(addr)->sin6_addr,16);
+		return true;
+	default:
+		clear();
+		return false;
+	}
+}
+
+bool IPAddress::is_set() const {
+	static const uint8_t zero[16] = {0};
+	return memcmp(bytes,zero,sizeof(bytes));
+}
+
+bool IPAddress::is_v4() const {
+	return !memcmp(bytes,v4_mapped,sizeof(v4_mapped));
+}
+
+const char* IPAddress::describe(char* buf,size_t len) const {
+	if(is_v4())
+		return inet_ntop(AF_INET,bytes+12,buf,len);
+	return inet_ntop(AF_INET6,bytes,buf,len);
+}
@@ -0,0 +1,52 @@
+/* (c) William Edwards, 2011
+   Using the Simplified BSD License.  See LICENSE file for details */
+
+#ifndef ADDRESS_HPP
+#define ADDRESS_HPP
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+class SocketAddress {
+	/* where to listen or connect, from a spec:
+		"1.2.3.4:80", ":80", "*:80" or just "80" for IPv4 (no host is any)
+		"[::1]:80" for IPv6; "[::]:80" is any, and takes IPv4 connections too
+		"unix:/path/to/socket" for a unix domain socket, and "unix:@name" for an abstract one
+	   Addresses are numeric; names aren't looked up */
+public:
+	SocketAddress();
+	bool parse(const char* spec); // false if it isn't a valid spec
+	int family() const { return addr.ss_family; }
+	bool is_ip() const { return (AF_INET == family()) || (AF_INET6 == family()); }
+	bool is_ipv6_any() const;
+	const sockaddr* get() const { return reinterpret_cast<const sockaddr*>(&addr); }
+	socklen_t length() const { return len; }
+	const char* get_path() const; // a unix socket's file; NULL if it's abstract or not unix
+	const char* describe() const { return spec; }
+private:
+	bool parse_port(const char* s,in_port_t& port);
+	sockaddr_storage addr;
+	socklen_t len;
+	char spec[sizeof(sockaddr_un::sun_path)+8];
+};
+
+class IPAddress {
+	/* a peer's address, IPv4 or IPv6, in 16 bytes; IPv4 is kept as ::ffff:a.b.c.d so the two can
+	   be keyed alike.  All zeros when it isn't known, or the peer isn't on IP */
+public:
+	IPAddress() { clear(); }
+	void clear() { memset(bytes,0,sizeof(bytes)); }
+	bool set(const sockaddr* addr); // false, and cleared, if it isn't IP
+	bool is_set() const;
+	bool is_v4() const;
+	const uint8_t* get() const { return bytes; }
+	const char* describe(char* buf,size_t len) const; // numeric, IPv4 dotted
+private:
+	uint8_t bytes[16];
+};
+
+#endif //ADDRESS_HPP
@@ -0,0 +1,375 @@
+/* (c) William Edwards, 2011
+   Using the Simplified BSD License.  See LICENSE file for details */
+
+/* a load generator for benchmarking helloworld and friends; deliberately doesn't use the
+   Scheduler so that it measures the server and not itself */
+
+#include "error.hpp"
+#include "time.hpp"
+#include "format.hpp"
+#include "ratelimit.hpp"
+#include "address.hpp"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <vector>
+
+static SocketAddress target;
+static bool keep_alive = false;
+static int requests_per_connection = 0; // 0 is unlimited
+static int pipeline = 1; // requests sent at a time on a keep-alive connection
+static int gap = 1000; // microseconds between pingpong requests
+
+static void die(const char* msg) {
+	perror(msg);
+	exit(1);
+}
+
+struct Client {
+	int fd;
+	char buf[16*1024];
+	size_t len;
+	int requests; // on this connection
+	int outstanding; // sent but not yet answered
+	time64_t sent;
+};
+
+static const char* request() {
+	return keep_alive?
+		"GET / HTTP/1.0\r\nConnection: keep-alive\r\n\r\n":
+		"GET / HTTP/1.0\r\n\r\n";
+}
+
+static uint32_t micros(const time64_t& t) {
+	return time64_to_millisecs64(t*1000);
+}
+
+static bool send_requests(Client& c,int count) {
+	const char* req = request();
+	const size_t len = strlen(req);
+	char batch[sizeof(c.buf)];
+	for(int i=0; i<count; i++)
+		memcpy(batch+i*len,req,len);
+	c.outstanding = count;
+	c.sent = time64_now();
+	return ((ssize_t)(count*len) == ::write(c.fd,batch,count*len));
+}
+
+static int connect_client(int epoll_fd,Client& c) {
+	c.fd = socket(target.family(),SOCK_STREAM|SOCK_NONBLOCK,0);
+	if(0>c.fd)
+		die("socket");
+	c.len = 0;
+	c.requests = 0;
+	c.outstanding = 0;
+	if(connect(c.fd,target.get(),target.length()) && (EINPROGRESS != errno))
+		die("connect");
+	epoll_event event;
+	event.events = EPOLLOUT;
+	event.data.ptr = &c;
+	if(epoll_ctl(epoll_fd,EPOLL_CTL_ADD,c.fd,&event))
+		die("epoll_ctl");
+	return c.fd;
+}
+
+static size_t response_length(Client& c) {
+	// a keep-alive response is complete when we have the headers and content-length bytes of body
+	c.buf[c.len] = 0;
+	const char* body = strstr(c.buf,"\r\n\r\n");
+	if(!body)
+		return 0;
+	const char* cl = strcasestr(c.buf,"content-length:");
+	if(!cl || cl > body)
+		return 0;
+	const size_t len = (body+4-c.buf)+atoi(cl+15);
+	return (c.len >= len)? len: 0;
+}
+
+static void print_latencies(std::vector<uint32_t>& latencies) {
+	if(latencies.empty())
+		return;
+	std::sort(latencies.begin(),latencies.end());
+	printf("latency us: p50 %" PRIu32 ", p99 %" PRIu32 ", p99.9 %" PRIu32 ", max %" PRIu32 "\n",
+		latencies[latencies.size()/2],latencies[latencies.size()*99/100],
+		latencies[latencies.size()*999/1000],latencies.back());
+}
+
+/* opens connections and makes requests, -c at a time, until -n requests have been served;
+   without -k every request is a new connection, which is the connection-churn case.  Reports
+   latency percentiles too, where a request's latency is from sending its batch to its response */
+static int churn(int requests,int concurrency) {
+	const int epoll_fd = epoll_create1(0);
+	if(0>epoll_fd)
+		die("epoll_create1");
+	const int batch = keep_alive? pipeline: 1;
+	Client* clients = new Client[concurrency];
+	std::vector<uint32_t> latencies;
+	latencies.reserve(requests);
+	int started = 0, completed = 0, failed = 0;
+	const time64_t start = time64_now();
+	for(int i=0; (i<concurrency) && (started<requests); i++, started++)
+		connect_client(epoll_fd,clients[i]);
+	epoll_event events[256];
+	while(completed+failed < requests) {
+		const int nfds = epoll_wait(epoll_fd,events,256,1000);
+		if(0>nfds)
+			die("epoll_wait");
+		if(!nfds) {
+			fprintf(stderr,"timed out with %d outstanding\n",started-completed-failed);
+			break;
+		}
+		for(int i=0; i<nfds; i++) {
+			Client& c = *reinterpret_cast<Client*>(events[i].data.ptr);
+			bool done = false, ok = true;
+			if(EPOLLOUT & events[i].events) {
+				const int count = std::min(batch,requests-started+1);
+				if(!send_requests(c,count))
+					ok = false;
+				else {
+					started += count-1;
+					epoll_event event;
+					event.events = EPOLLIN;
+					event.data.ptr = &c;
+					if(epoll_ctl(epoll_fd,EPOLL_CTL_MOD,c.fd,&event))
+						die("epoll_ctl");
+				}
+			} else if(EPOLLIN & events[i].events) {
+				const ssize_t bytes = ::read(c.fd,c.buf+c.len,sizeof(c.buf)-c.len-1);
+				if(0<bytes) {
+					c.len += bytes;
+					if(keep_alive)
+						while(const size_t len = response_length(c)) {
+							memmove(c.buf,c.buf+len,c.len-len);
+							c.len -= len;
+							completed++;
+							latencies.push_back(micros(time64_now()-c.sent));
+							if(!--c.outstanding) {
+								done = true;
+								break;
+							}
+						}
+				} else if(!bytes) { // closed by the server
+					ok = done = (!keep_alive && c.len);
+					if(done) {
+						completed++;
+						latencies.push_back(micros(time64_now()-c.sent));
+					}
+				} else
+					ok = (EAGAIN == errno);
+			} else
+				ok = false;
+			if(!ok)
+				failed += std::max(1,c.outstanding);
+			if(!done && ok)
+				continue;
+			c.requests += batch;
+			if(done && keep_alive && (started < requests) &&
+				(!requests_per_connection || (c.requests < requests_per_connection))) {
+				// reuse the connection
+				const int count = std::min(batch,requests-started);
+				started += count;
+				c.len = 0;
+				if(send_requests(c,count))
+					continue;
+				failed += count;
+			}
+			close(c.fd);
+			if(started < requests) {
+				started++;
+				connect_client(epoll_fd,c);
+			}
+		}
+	}
+	const time64_t elapsed = time64_now() - start;
+	printf("%d requests, %d failed, in %" PRIu64 " ms: %.0f requests/sec\n",
+		completed,failed,time64_to_millisecs64(elapsed),
+		(completed * 1000.0) / std::max<uint64_t>(1,time64_to_millisecs64(elapsed)));
+	print_latencies(latencies);
+	delete[] clients;
+	close(epoll_fd);
+	return (failed? 1: 0);
+}
+
+/* one request at a time on one keep-alive connection, with -g microseconds between them so the
+   server has gone back to sleep each time: the idle-to-response latency that busy polling is for */
+static int pingpong(int requests) {
+	keep_alive = true;
+	Client c;
+	c.fd = socket(target.family(),SOCK_STREAM,0);
+	if(0>c.fd)
+		die("socket");
+	if(connect(c.fd,target.get(),target.length()))
+		die("connect");
+	int yes = 1;
+	if(target.is_ip() && setsockopt(c.fd,IPPROTO_TCP,TCP_NODELAY,&yes,sizeof(yes)))
+		die("setsockopt");
+	std::vector<uint32_t> latencies;
+	latencies.reserve(requests);
+	int failed = 0;
+	for(int i=0; (i<requests) && !failed; i++) {
+		c.len = 0;
+		if(!send_requests(c,1))
+			die("write");
+		size_t len;
+		while(!(len = response_length(c))) {
+			const ssize_t bytes = ::read(c.fd,c.buf+c.len,sizeof(c.buf)-c.len-1);
+			if(0>=bytes) {
+				failed++;
+				break;
+			}
+			c.len += bytes;
+		}
+		if(len)
+			latencies.push_back(micros(time64_now()-c.sent));
+		if(gap)
+			usleep(gap);
+	}
+	close(c.fd);
+	printf("%zu round trips, %d failed, %d us apart\n",latencies.size(),failed,gap);
+	print_latencies(latencies);
+	return (failed? 1: 0);
+}
+
+/* what the HTTP code formats on every response, with snprintf and with fmt; the lengths are
+   summed so that neither is optimised away */
+static int format(int iterations) {
+	static const char* date = "Sun, 06 Nov 1994 08:49:37 GMT";
+	char buf[256];
+	size_t check[2] = {0,0};
+	time64_t elapsed[2];
+	for(int pass=0; pass<2; pass++) {
+		const time64_t start = time64_now();
+		for(int i=0; i<iterations; i++) {
+			const char* header = (i&1)? "Content-Length": "Content-Type";
+			if(!pass) {
+				check[pass] += snprintf(buf,sizeof(buf),"HTTP/%s %d %s\r\nDate: %s\r\nConnection: %s\r\n",
+					"1.1",200+(i&3),"OK",date,"keep-alive");
+				check[pass] += snprintf(buf,sizeof(buf),"%s: %s\r\n",header,"text/plain");
+				check[pass] += snprintf(buf,sizeof(buf),"\r\n%zx\r\n",(size_t)i);
+				check[pass] += snprintf(buf,sizeof(buf),"World %6d",i);
+			} else {
+				check[pass] += fmt::render_all(buf,fmt::piece("HTTP/1.1 "),200+(i&3),' ',fmt::piece("OK"),
+					fmt::piece("\r\nDate: "),fmt::piece(date),fmt::piece("\r\nConnection: keep-alive\r\n")) - buf;
+				check[pass] += fmt::render_all(buf,fmt::piece(header),fmt::piece(": "),fmt::piece("text/plain"),
+					fmt::piece("\r\n")) - buf;
+				check[pass] += fmt::render_all(buf,fmt::piece("\r\n"),fmt::Hex(i),fmt::piece("\r\n")) - buf;
+				check[pass] += fmt::render_all(buf,fmt::piece("World "),fmt::Dec(i,6)) - buf;
+			}
+		}
+		elapsed[pass] = time64_now() - start;
+	}
+	if(check[0] != check[1]) {
+		fprintf(stderr,"fmt rendered %zu bytes but snprintf %zu\n",check[1],check[0]);
+		return 1;
+	}
+	for(int pass=0; pass<2; pass++)
+		printf("%-8s %d responses' worth in %" PRIu64 " ms: %.0f ns each\n",pass? "fmt": "snprintf",iterations,
+			time64_to_millisecs64(elapsed[pass]),(time64_to_millisecs64(elapsed[pass]*1000)*1000.0)/iterations);
+	return 0;
+}
+
+/* token bucket checks, round-robin over clients' addresses spread across the IPv4 space, so
+   there are misses and evictions once there are more clients than the table's buckets */
+static int ratelimit(int iterations,int clients) {
+	RateLimiter limiter(1000,100);
+	std::vector<IPAddress> addrs(clients);
+	for(int i=0; i<clients; i++) {
+		sockaddr_in in;
+		memset(&in,0,sizeof(in));
+		in.sin_family = AF_INET;
+		in.sin_addr.s_addr = htonl(0x0a000000 + i*2654435761U % 0x00ffffff);
+		addrs[i].set(reinterpret_cast<const sockaddr*>(&in));
+	}
+	const time64_t start = time64_now();
+	time64_t now = start;
+	int c = 0;
+	for(int i=0; i<iterations; i++) {
+		if(!(i&1023))
+			now = time64_now();
+		limiter.take(addrs[c],now);
+		if(++c == clients)
+			c = 0;
+	}
+	const time64_t elapsed = time64_now() - start;
+	const RateLimiter::Stats& stats = limiter.get_stats();
+	printf("%d checks over %d clients in %" PRIu64 " ms: %.1f ns each; %" PRIu64 " allowed, %" PRIu64 " limited, %" PRIu64 " evictions\n",
+		iterations,clients,time64_to_millisecs64(elapsed),(time64_to_millisecs64(elapsed*1000)*1000.0)/iterations,
+		stats.allowed,stats.limited,stats.evictions);
+	return 0;
+}
+
+int main(int argc,char* argv[]) {
+	const char* addr = "127.0.0.1";
+	int port = 42042, requests = 10000, concurrency = 25;
+	int opt;
+	while((opt = getopt(argc,argv,"a:p:n:c:kr:P:g:h")) != -1) {
+		switch(opt) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'n':
+			requests = atoi(optarg);
+			break;
+		case 'c':
+			concurrency = atoi(optarg);
+			break;
+		case 'k':
+			keep_alive = true;
+			break;
+		case 'r':
+			requests_per_connection = atoi(optarg);
+			break;
+		case 'P':
+			pipeline = std::max(1,std::min(atoi(optarg),256));
+			break;
+		case 'g':
+			gap = std::max(0,atoi(optarg));
+			break;
+		default:
+			fprintf(stderr,"usage: ./bench {-a [addr]} {-p [port]} {-n [requests]} {-c [concurrency]} {-k} {-r [requests]} {-P [depth]} {-g [usecs]} {mode}\n"
+			"  -a is a host to use with -p, or an address such as [::1]:80 or unix:/path (see address.hpp)\n"
+			"  -r is the number of requests per keep-alive connection before the client closes it\n"
+			"  -P is how many requests to pipeline at a time on a keep-alive connection\n"
+			"  -g is the gap between pingpong requests\n"
+				"  modes are:\n"
+				"    churn  (default) HTTP requests; a new connection for each unless -k\n"
+				"    pingpong -n requests one at a time on a connection, to time responses from idle\n"
+				"    format -n iterations of formatting a response's status line and headers, with snprintf and fmt\n"
+				"    ratelimit -n per-client rate limit checks over -c clients\n");
+			return ('h' == opt)? 0: 1;
+		}
+	}
+	const char* mode = (optind < argc)? argv[optind]: "churn";
+	char spec[128];
+	if(strchr(addr,':')) // a whole spec
+		snprintf(spec,sizeof(spec),"%s",addr);
+	else
+		snprintf(spec,sizeof(spec),"%s:%d",addr,port);
+	if(!target.parse(spec)) {
+		fprintf(stderr,"bad address %s\n",spec);
+		return 1;
+	}
+	if(!strcmp(mode,"churn"))
+		return churn(requests,std::max(1,concurrency));
+	if(!strcmp(mode,"pingpong"))
+		return pingpong(requests);
+	if(!strcmp(mode,"format"))
+		return format(requests);
+	if(!strcmp(mode,"ratelimit"))
+		return ratelimit(requests,std::max(1,concurrency));
+	fprintf(stderr,"unknown mode %s\n",mode);
+	return 1;
+}
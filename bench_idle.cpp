@@ -0,0 +1,109 @@
+/* (c) William Edwards, 2011
+   Using the Simplified BSD License.  See LICENSE file for details */
+
+/* measures what an idle HTTP connection costs: opens lots of socketpair connections into
+   HttpServerConnections, has each of them serve a keep-alive request, and reports how much
+   the RSS grew per connection.  A million connections needs a couple of million FDs, so
+   raise ulimit -n (and fs.nr_open) first */
+
+#include "http.hpp"
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <vector>
+
+class IdleServer: public HttpServerConnection {
+public:
+	static void factory(Scheduler& scheduler,FD accept_fd);
+	static int served, expected;
+protected:
+	IdleServer(Scheduler& scheduler,FD accept_fd): HttpServerConnection(scheduler,accept_fd) {}
+	void on_body();
+};
+
+int IdleServer::served = 0, IdleServer::expected = 0;
+
+void IdleServer::factory(Scheduler& scheduler,FD accept_fd) {
+	Cleanup<HttpServerConnection,CleanupClose> client(new IdleServer(scheduler,accept_fd));
+	client->construct();
+	client.detach();
+}
+
+void IdleServer::on_body() {
+	writeHeader("Content-Length","5");
+	write("idle\n");
+	finish();
+	if(++served == expected)
+		ThrowShutdown("all served");
+}
+
+static size_t rss() {
+	size_t pages = 0, resident = 0;
+	if(FILE* f = fopen("/proc/self/statm","r")) {
+		if(2 != fscanf(f,"%zu %zu",&pages,&resident))
+			resident = 0;
+		fclose(f);
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+int main(int argc,char* argv[]) {
+	int connections = 10000;
+	bool request = true;
+	int opt;
+	while((opt = getopt(argc,argv,"n:qh")) != -1) {
+		switch(opt) {
+		case 'n':
+			connections = atoi(optarg);
+			break;
+		case 'q':
+			request = false;
+			break;
+		default:
+			fprintf(stderr,"usage: ./bench_idle {-n [connections]} {-q}\n"
+				"  -q leaves the connections quiet, rather than each serving one keep-alive request first\n");
+			return ('h' == opt)? 0: 1;
+		}
+	}
+	rlimit limit;
+	check(getrlimit(RLIMIT_NOFILE,&limit));
+	limit.rlim_cur = limit.rlim_max;
+	check(setrlimit(RLIMIT_NOFILE,&limit));
+	if(limit.rlim_cur < (rlim_t)connections*2+16) {
+		connections = (limit.rlim_cur-16)/2;
+		fprintf(stderr,"only %d connections fit in ulimit -n %d\n",connections,(int)limit.rlim_cur);
+	}
+	try {
+		Scheduler scheduler;
+		scheduler.enable_timeouts(false);
+		std::vector<FD> clients;
+		clients.reserve(connections);
+		const size_t before = rss();
+		static const char req[] = "GET / HTTP/1.1\r\n\r\n";
+		for(int i=0; i<connections; i++) {
+			FD sv[2];
+			check(socketpair(AF_UNIX,SOCK_STREAM,0,sv));
+			clients.push_back(sv[1]);
+			IdleServer::factory(scheduler,sv[0]);
+			if(request)
+				check(::write(sv[1],req,sizeof(req)-1));
+		}
+		if(request) {
+			IdleServer::expected = connections;
+			scheduler.run();
+		}
+		const size_t after = rss();
+		printf("%d %s connections of %zu bytes each: RSS grew %zu KB, %zu bytes per connection\n",
+			connections,request?"idle keep-alive":"quiet",sizeof(IdleServer),
+			(after-before)/1024,(after-before)/std::max(1,connections));
+		for(size_t i=0; i<clients.size(); i++)
+			::close(clients[i]);
+	} catch(Error* e) {
+		e->dump();
+		e->release();
+		return 1;
+	}
+	return 0;
+}
@@ -2,6 +2,7 @@
    Using the Simplified BSD License.  See LICENSE file for details */
 
 #include "console.hpp"
+#include "ratelimit.hpp"
 
 extern "C" {
 	#include <fcntl.h>
@@ -27,7 +28,30 @@ void Console::read() {
 			return;
 		if(!strcasecmp("help\n",line.cstr())) {
 			printf("Available commands are:\n"
+				"\tstats\n"
 				"\tquit\n");
+		} else if(!strcasecmp("stats\n",line.cstr())) {
+			const Scheduler::PollStats poll = scheduler.get_poll_stats();
+			const Scheduler::OutStats& out = scheduler.get_out_stats();
+			const Scheduler::LoadStats& load = scheduler.get_load_stats();
+			printf("epoll: %" PRIu64 " waits with events, %" PRIu64 " sleeps, %" PRIu64 " spins (%" PRIu64 " hit), max_events %d\n"
+				"epoll_ctl: %" PRIu64 " add, %" PRIu64 " mod, %" PRIu64 " del; %" PRIu64 " unwanted events filtered\n"
+				"out: %" PRIu64 " queued, %" PRIu64 " coalesced, %" PRIu64 " nodes, longest queue %" PRIu32 "\n"
+				"load: %" PRIu32 " connections, %" PRIu32 " requests in flight, lag %" PRIu64 " ms (max %" PRIu64 "), %" PRIu64 " shed, %" PRIu64 " accept pauses\n"
+				"reaping: %" PRIu64 " missed deadlines, %" PRIu64 " reaped whilst idle, %zu buffer bytes in use\n",
+				poll.waits,poll.sleeps,poll.spins,poll.spin_hits,poll.max_events,
+				poll.ctl_add,poll.ctl_mod,poll.ctl_del,poll.filtered,
+				out.queued,out.coalesced,out.nodes,out.max_length,
+				load.connections,load.requests,time64_to_millisecs64(load.lag),time64_to_millisecs64(load.max_lag),
+				load.shed,load.accept_pauses,
+				load.deadlines,load.reaped,scheduler.get_buffers().get_bytes_in_use());
+			const RateLimiter* rate_limits[2] = {scheduler.get_connection_rate_limit(),scheduler.get_request_rate_limit()};
+			for(int i=0; i<2; i++)
+				if(rate_limits[i]) {
+					const RateLimiter::Stats& rate = rate_limits[i]->get_stats();
+					printf("%s rate limit: %" PRIu64 " allowed, %" PRIu64 " delayed, %" PRIu64 " limited, %" PRIu64 " evictions\n",
+						i? "request": "connection",rate.allowed,rate.delayed,rate.limited,rate.evictions);
+				}
 		} else if(!strcasecmp("quit\n",line.cstr())) {
 			ThrowShutdown("<goodbye>");
 		} else {
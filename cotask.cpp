@@ -0,0 +1,140 @@
+/* (c) William Edwards, 2011
+   Using the Simplified BSD License.  See LICENSE file for details */
+
+#include "cotask.hpp"
+
+CoTask::CoTask(Scheduler& scheduler,Task* parent): Task(scheduler,parent),
+	alarm(*this), poller(NULL), waiting(WAIT_NONE) {}
+
+CoTask::~CoTask() {
+	if(co)
+		co.destroy();
+}
+
+void CoTask::read() {
+	switch(waiting) {
+	case WAIT_NONE: // just constructed
+		if(co) {
+			defer_input();
+			return;
+		}
+		co = suspended = main().release();
+		break;
+	case WAIT_INPUT:
+		if(!poller->poll()) // still nothing
+			return;
+		break;
+	case WAIT_OUTPUT:
+		if(out) {
+			defer_input();
+			return;
+		}
+		break;
+	case WAIT_TIME:
+		if(alarm.is_pending()) {
+			defer_input();
+			return;
+		}
+		break;
+	}
+	resume();
+}
+
+void CoTask::drained() {
+	if(WAIT_OUTPUT == waiting)
+		yield();
+}
+
+void CoTask::Alarm::on_timer(const time64_t& now) {
+	if(WAIT_TIME == task.waiting)
+		task.yield();
+}
+
+void CoTask::wait(Waiting what,std::coroutine_handle<> h,Poller* p) {
+	waiting = what;
+	suspended = h;
+	poller = p;
+	if(WAIT_INPUT != what) // the poller would-blocked, so is sated
+		defer_input();
+}
+
+void CoTask::resume() {
+	waiting = WAIT_NONE;
+	poller = NULL;
+	suspended.resume();
+	if(!co.done())
+		return;
+	// main() has finished
+	defer_input();
+	Co::Handle h = Co::Handle::from_address(co.address());
+	if(std::exception_ptr error = h.promise().error) {
+		h.promise().error = NULL;
+		std::rethrow_exception(error);
+	}
+	graceful_close();
+}
+
+CoTask::ReadBytes CoTask::async_read(void* ptr,size_t bytes) {
+	return ReadBytes(*this,ptr,bytes);
+}
+
+bool CoTask::ReadBytes::poll() {
+	if(got == bytes)
+		return true;
+	ssize_t read;
+	const IoStatus status = task.try_read(ptr+got,bytes-got,read);
+	got += read;
+	if(IO_AGAIN == status)
+		return false;
+	eos = (IO_EOS == status);
+	return true;
+}
+
+CoTask::Flushed CoTask::flushed() {
+	return Flushed(*this);
+}
+
+bool CoTask::Flushed::await_ready() {
+	if(IO_EOS == task.try_write_buffered())
+		ThrowEndOfStreamError();
+	return !task.out;
+}
+
+CoTask::Sleep CoTask::sleep(uint32_t millisecs) {
+	return Sleep(*this,millisecs);
+}
+
+void CoTask::Sleep::await_suspend(std::coroutine_handle<> h) {
+	task.scheduler.call_later(&task.alarm,millisecs);
+	task.wait(WAIT_TIME,h);
+}
+
+/* frames are prefixed with the pool they came from, as the sized operator delete isn't told */
+union FramePrefix {
+	BufferPool* pool;
+	max_align_t align;
+};
+
+void* CoTask::Co::promise_type::alloc(size_t size,BufferPool& pool) {
+	FramePrefix* prefix = reinterpret_cast<FramePrefix*>(pool.alloc(sizeof(FramePrefix)+size));
+	prefix->pool = &pool;
+	return prefix+1;
+}
+
+void CoTask::Co::promise_type::operator delete(void* ptr,size_t size) {
+	FramePrefix* prefix = reinterpret_cast<FramePrefix*>(ptr)-1;
+	prefix->pool->release(prefix,sizeof(FramePrefix)+size);
+}
+
+std::coroutine_handle<> CoTask::Co::FinalAwaiter::await_suspend(Handle h) noexcept {
+	if(h.promise().continuation)
+		return h.promise().continuation;
+	return std::noop_coroutine();
+}
+
+void CoTask::Co::await_resume() {
+	if(std::exception_ptr error = handle.promise().error) {
+		handle.promise().error = NULL;
+		std::rethrow_exception(error);
+	}
+}
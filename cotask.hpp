@@ -0,0 +1,159 @@
+/* (c) William Edwards, 2011
+   Using the Simplified BSD License.  See LICENSE file for details */
+
+#ifndef COTASK_HPP
+#define COTASK_HPP
+
+#include "task.hpp"
+
+#include <coroutine>
+#include <exception>
+
+class CoTask: public Task {
+	/* a Task whose protocol is written as a coroutine, main(), that co_awaits input, output and
+	   time instead of being a state machine re-entered on every event.  It is only ever resumed
+	   from read(), so it runs like any other handler: would-block suspends it, and anything it
+	   throws closes the task.  Coroutine frames come from the scheduler's BufferPool */
+public:
+	class Co;
+protected:
+	CoTask(Scheduler& scheduler,Task* parent = NULL);
+	~CoTask();
+	virtual Co main() = 0; // the task is gracefully closed when it returns
+	// awaitables; the reads resume with false at the end of the input stream
+	template<class InLine> class ReadLine;
+	template<class InLine> ReadLine<InLine> async_read_line(InLine& line); // a line longer than InLine comes in pieces
+	class ReadBytes;
+	ReadBytes async_read(void* ptr,size_t bytes);
+	using Task::async_read;
+	class Flushed;
+	Flushed flushed(); // all output sent
+	class Sleep;
+	Sleep sleep(uint32_t millisecs);
+private:
+	void read();
+	void drained();
+	void resume();
+	class Poller {
+	public:
+		virtual bool poll() = 0; // true when done; false when it would block
+	};
+	enum Waiting {
+		WAIT_NONE,
+		WAIT_INPUT,
+		WAIT_OUTPUT,
+		WAIT_TIME,
+	};
+	void wait(Waiting what,std::coroutine_handle<> h,Poller* poller = NULL);
+	struct Alarm: public Timer {
+		Alarm(CoTask& t): task(t) {}
+		void on_timer(const time64_t& now);
+		CoTask& task;
+	} alarm;
+	std::coroutine_handle<> co; // main()
+	std::coroutine_handle<> suspended; // main() or whatever it is co_awaiting
+	Poller* poller;
+	Waiting waiting;
+};
+
+class CoTask::Co {
+	/* what main() returns; a main() can co_await other CoTask member functions that return Co too,
+	   so that their frames come from the same pool */
+public:
+	struct promise_type;
+	typedef std::coroutine_handle<promise_type> Handle;
+	struct FinalAwaiter {
+		bool await_ready() noexcept { return false; }
+		std::coroutine_handle<> await_suspend(Handle h) noexcept;
+		void await_resume() noexcept {}
+	};
+	struct promise_type {
+		static void* operator new(size_t size,CoTask& task) { return alloc(size,task.scheduler.get_buffers()); }
+		template<typename... Args> static void* operator new(size_t size,CoTask& task,const Args&...) {
+			return alloc(size,task.scheduler.get_buffers());
+		}
+		static void operator delete(void* ptr,size_t size);
+		Co get_return_object() { return Co(Handle::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return std::suspend_always(); }
+		FinalAwaiter final_suspend() noexcept { return FinalAwaiter(); }
+		void return_void() {}
+		void unhandled_exception() { error = std::current_exception(); }
+		std::coroutine_handle<> continuation; // the coroutine co_awaiting this one
+		std::exception_ptr error;
+	private:
+		static void* alloc(size_t size,BufferPool& pool);
+	};
+	Co(Co&& other): handle(other.handle) { other.handle = NULL; }
+	~Co() { if(handle) handle.destroy(); }
+	Handle release() { Handle h = handle; handle = NULL; return h; }
+	// co_awaiting a sub-coroutine runs it to completion, rethrowing anything it throws
+	bool await_ready() { return false; }
+	Handle await_suspend(std::coroutine_handle<> h) { handle.promise().continuation = h; return handle; }
+	void await_resume();
+private:
+	explicit Co(Handle h): handle(h) {}
+	Co(const Co&);
+	Handle handle;
+};
+
+template<class InLine> class CoTask::ReadLine: private CoTask::Poller {
+public:
+	ReadLine(CoTask& t,InLine& l): task(t), line(l), eos(false) { line.clear(); }
+	bool await_ready() { return poll(); }
+	void await_suspend(std::coroutine_handle<> h) { task.wait(WAIT_INPUT,h,this); }
+	bool await_resume() const { return !eos; }
+private:
+	bool poll() {
+		const IoStatus status = task.try_read_in(line);
+		if(IO_AGAIN == status)
+			return false;
+		eos = (IO_EOS == status);
+		line.chomp();
+		return true;
+	}
+	CoTask& task;
+	InLine& line;
+	bool eos;
+};
+
+class CoTask::ReadBytes: private CoTask::Poller {
+public:
+	ReadBytes(CoTask& t,void* p,size_t b): task(t), ptr(reinterpret_cast<uint8_t*>(p)), bytes(b), got(0), eos(false) {}
+	bool await_ready() { return poll(); }
+	void await_suspend(std::coroutine_handle<> h) { task.wait(WAIT_INPUT,h,this); }
+	bool await_resume() const { return !eos; }
+private:
+	bool poll();
+	CoTask& task;
+	uint8_t* const ptr;
+	const size_t bytes;
+	size_t got;
+	bool eos;
+};
+
+class CoTask::Flushed {
+public:
+	explicit Flushed(CoTask& t): task(t) {}
+	bool await_ready();
+	void await_suspend(std::coroutine_handle<> h) { task.wait(WAIT_OUTPUT,h); }
+	void await_resume() {}
+private:
+	CoTask& task;
+};
+
+class CoTask::Sleep {
+public:
+	Sleep(CoTask& t,uint32_t ms): task(t), millisecs(ms) {}
+	bool await_ready() const { return !millisecs; }
+	void await_suspend(std::coroutine_handle<> h);
+	void await_resume() {}
+private:
+	CoTask& task;
+	const uint32_t millisecs;
+};
+
+template<class InLine> CoTask::ReadLine<InLine> CoTask::async_read_line(InLine& line) {
+	return ReadLine<InLine>(*this,line);
+}
+
+#endif //COTASK_HPP
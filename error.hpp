@@ -8,6 +8,7 @@
 #include <inttypes.h>
 #undef __STDC_FORMAT_MACROS
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <errno.h>
 #include <exception>
@@ -42,15 +43,15 @@ private:
 	T* t;
 };
 
-class Closeable {
+class ErrorContext {
 public:
-	virtual bool is_closed() const = 0;
-	virtual void close() = 0;
+	virtual void dump_context(FILE* out=stdout) const = 0;
 };
 
-class ErrorContext {
+class Closeable: public ErrorContext {
 public:
-	virtual void dump_context(FILE* out=stdout) const = 0;
+	virtual bool is_closed() const = 0;
+	virtual void close() = 0;
 };
 
 class Error {
@@ -64,6 +65,14 @@ protected:
 
 class EndOfStreamError: public Error {};
 
+/* the result of the non-throwing try_ IO calls; the async_ calls throw an EndOfStreamError or HalfClose
+   instead of returning IO_EOS, and are convenient when the end of a stream really is unexpected */
+enum IoStatus {
+	IO_OK,		// completed
+	IO_AGAIN,	// would block; wait for the next event
+	IO_EOS,		// end of stream
+};
+
 /* a HalfClose is an error where any already-queued Out messages are delivered before the connection is closed */
 struct HalfClose: public Error {
 	const char* msg;
@@ -0,0 +1,81 @@
+/* (c) William Edwards, 2011
+   Using the Simplified BSD License.  See LICENSE file for details */
+
+#include "format.hpp"
+
+namespace fmt {
+
+static const char digit_pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static unsigned count_digits(uint64_t value) {
+	unsigned digits = 1;
+	for(;;) {
+		if(value < 10) return digits;
+		if(value < 100) return digits+1;
+		if(value < 1000) return digits+2;
+		if(value < 10000) return digits+3;
+		value /= 10000;
+		digits += 4;
+	}
+}
+
+static void render_digits(char* end,uint64_t value) {
+	// backwards from end, two at a time
+	while(value >= 100) {
+		const unsigned pair = (value % 100) * 2;
+		value /= 100;
+		*--end = digit_pairs[pair+1];
+		*--end = digit_pairs[pair];
+	}
+	if(value >= 10) {
+		*--end = digit_pairs[value*2+1];
+		*--end = digit_pairs[value*2];
+	} else
+		*--end = '0'+value;
+}
+
+char* render_unsigned(char* dest,uint64_t value) {
+	dest += count_digits(value);
+	render_digits(dest,value);
+	return dest;
+}
+
+char* render_signed(char* dest,int64_t value) {
+	if(0 > value) {
+		*dest++ = '-';
+		return render_unsigned(dest,0-(uint64_t)value);
+	}
+	return render_unsigned(dest,value);
+}
+
+char* render_hex(char* dest,uint64_t value) {
+	static const char hex[] = "0123456789abcdef";
+	unsigned nibbles = 1;
+	while((nibbles < 16) && (value >> (nibbles*4)))
+		nibbles++;
+	for(char* c = dest+nibbles; c != dest; value >>= 4)
+		*--c = hex[value & 0xf];
+	return dest+nibbles;
+}
+
+char* render_dec(char* dest,const Dec& dec) {
+	const uint64_t magnitude = (0 > dec.value)? 0-(uint64_t)dec.value: dec.value;
+	const unsigned len = count_digits(magnitude) + ((0 > dec.value)? 1: 0);
+	if(len < dec.width) {
+		memset(dest,' ',dec.width-len);
+		dest += dec.width-len;
+	}
+	return render_signed(dest,dec.value);
+}
+
+} // namespace fmt
@@ -0,0 +1,77 @@
+/* (c) William Edwards, 2011
+   Using the Simplified BSD License.  See LICENSE file for details */
+
+#ifndef FORMAT_HPP
+#define FORMAT_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+namespace fmt {
+/* a typed formatter: rather than a format string, the arguments are the pieces to output, and
+   each renders itself.  Their worst-case lengths are summed first so they can be rendered
+   straight into a buffer without checks.  const char*s are copied, integers are decimal, and
+   Hex() and Dec() wrap integers for hex or space-padding; anything else doesn't compile */
+
+struct Str {
+	Str(const char* p,size_t l): ptr(p), len(l) {}
+	const char* ptr;
+	size_t len;
+};
+
+struct Hex {
+	explicit Hex(uint64_t v): value(v) {}
+	uint64_t value;
+};
+
+struct Dec {
+	Dec(int64_t v,unsigned w): value(v), width(w < 20? w: 20) {} // right-aligned in width
+	int64_t value;
+	unsigned width;
+};
+
+char* render_unsigned(char* dest,uint64_t value);
+char* render_signed(char* dest,int64_t value);
+char* render_hex(char* dest,uint64_t value);
+char* render_dec(char* dest,const Dec& dec);
+
+// what each argument becomes, so that strlen is done only once
+inline Str piece(const char* s) { return Str(s,strlen(s)); }
+inline const Str& piece(const Str& s) { return s; }
+inline Hex piece(const Hex& h) { return h; }
+inline Dec piece(const Dec& d) { return d; }
+template<typename T> inline typename std::enable_if<std::is_integral<T>::value,T>::type piece(T t) { return t; } // chars are characters
+
+inline size_t max_len(const Str& s) { return s.len; }
+inline size_t max_len(const Hex&) { return 16; }
+inline size_t max_len(const Dec&) { return 20; }
+template<typename T> inline size_t max_len(T) {
+	return std::is_same<T,char>::value? 1: 20; // "-9223372036854775808" and 18446744073709551615
+}
+
+inline char* render(char* dest,const Str& s) { memcpy(dest,s.ptr,s.len); return dest+s.len; }
+inline char* render(char* dest,const Hex& h) { return render_hex(dest,h.value); }
+inline char* render(char* dest,const Dec& d) { return render_dec(dest,d); }
+template<typename T> inline char* render(char* dest,T t) {
+	if constexpr(std::is_same<T,char>::value) {
+		*dest = t;
+		return dest+1;
+	} else if constexpr(std::is_signed<T>::value)
+		return render_signed(dest,t);
+	else
+		return render_unsigned(dest,t);
+}
+
+template<typename... Pieces> size_t max_length(const Pieces&... pieces) {
+	return (max_len(pieces) + ... + 0);
+}
+
+template<typename... Pieces> char* render_all(char* dest,const Pieces&... pieces) {
+	((dest = render(dest,pieces)), ...);
+	return dest;
+}
+
+} // namespace fmt
+
+#endif //FORMAT_HPP
@@ -5,41 +5,208 @@
 #include "listener.hpp"
 #include "console.hpp"
 #include "http.hpp"
+#include "cotask.hpp"
+#include "ratelimit.hpp"
+#include "workers.hpp"
 
 #include <signal.h>
 #include <unistd.h>
 #include "valgrind/valgrind.h"
 
 /** todo:
-	* rate limiting by being level-triggered with counters in Task read and writes or
-		at the frame level, and with shuffling the epoll_wait() results
 	* sigaction() and daemon
 */
 
-class HelloWorld: public HttpServerConnection {
+class HelloWorld: public BasicHttpServerConnection<HelloWorld> {
 public:
 	static void factory(Scheduler& scheduler,FD accept_fd);
+	static HttpHeaderBlock headers; // the same on every response
 protected:
-	HelloWorld(Scheduler& scheduler,FD accept_fd): HttpServerConnection(scheduler,accept_fd), count(0) {}
+	friend class BasicHttpServerConnection<HelloWorld>;
+	HelloWorld(Scheduler& scheduler,FD accept_fd): BasicHttpServerConnection<HelloWorld>(scheduler,accept_fd), count(0) {}
 	void on_body(); 
 private:
 	int count;
 };
 
+HttpHeaderBlock HelloWorld::headers;
+
 void HelloWorld::factory(Scheduler& scheduler,FD accept_fd) {
-	Cleanup<HttpServerConnection,CleanupClose> client(new HelloWorld(scheduler,accept_fd));
+	Cleanup<HelloWorld,CleanupClose> client(new HelloWorld(scheduler,accept_fd));
 	client->construct();
 	client.detach();
 }
 
 void HelloWorld::on_body() {
 	count++;
-	writeHeader("Content-Length","18");
+	writeHeaders(headers);
 	write("Hello ");
-	writef("World %6d",count);
+	writeFormat("World ",fmt::Dec(count,6));
 	finish();
 }
 
+class SlowHelloWorld: public BasicHttpServerConnection<SlowHelloWorld> {
+	/* the same hello world as though each response waited on a backend: it is deferred, and a
+	   timer finishes it after up to wait millisecs.  The waits vary, so pipelined responses finish
+	   out of order, and the connection puts them back in order */
+public:
+	static void factory(Scheduler& scheduler,FD accept_fd);
+	static uint32_t wait;
+protected:
+	friend class BasicHttpServerConnection<SlowHelloWorld>;
+	SlowHelloWorld(Scheduler& scheduler,FD accept_fd): BasicHttpServerConnection<SlowHelloWorld>(scheduler,accept_fd),
+		replies(NULL), count(0) {}
+	~SlowHelloWorld();
+	void on_body();
+private:
+	struct Reply: public Timer {
+		Reply(SlowHelloWorld& c,HttpResponse* r,int n): connection(c), response(r), count(n), next(c.replies) {}
+		void on_timer(const time64_t& now);
+		SlowHelloWorld& connection;
+		HttpResponse* response;
+		int count;
+		Reply* next;
+	};
+	Reply* replies; // waiting
+	int count;
+};
+
+uint32_t SlowHelloWorld::wait = 0;
+
+void SlowHelloWorld::factory(Scheduler& scheduler,FD accept_fd) {
+	Cleanup<SlowHelloWorld,CleanupClose> client(new SlowHelloWorld(scheduler,accept_fd));
+	client->construct();
+	client.detach();
+}
+
+SlowHelloWorld::~SlowHelloWorld() {
+	while(Reply* reply = replies) { // their responses go with the connection
+		replies = reply->next;
+		delete reply;
+	}
+}
+
+void SlowHelloWorld::on_body() {
+	count++;
+	replies = new Reply(*this,defer(),count);
+	scheduler.call_later(replies,wait-(count%3)*wait/3); // so the later can finish first
+}
+
+void SlowHelloWorld::Reply::on_timer(const time64_t& now) {
+	Reply** r = &connection.replies;
+	while(*r != this)
+		r = &(*r)->next;
+	*r = next;
+	Cleanup<Reply> cleanup(this);
+	response->writeHeaders(HelloWorld::headers);
+	response->write("Hello ");
+	response->writeFormat("World ",fmt::Dec(count,6));
+	response->finish();
+}
+
+class UploadHelloWorld: public BasicHttpServerConnection<UploadHelloWorld> {
+	/* takes each request's body whole, spooled to a file if it is big, and says how long it was,
+	   where it was kept and its adler32, so spooling can be checked against the client's copy */
+public:
+	static void factory(Scheduler& scheduler,FD accept_fd);
+protected:
+	friend class BasicHttpServerConnection<UploadHelloWorld>;
+	UploadHelloWorld(Scheduler& scheduler,FD accept_fd): BasicHttpServerConnection<UploadHelloWorld>(scheduler,accept_fd) {}
+	void on_body_complete(HttpBody& body);
+};
+
+void UploadHelloWorld::factory(Scheduler& scheduler,FD accept_fd) {
+	Cleanup<UploadHelloWorld,CleanupClose> client(new UploadHelloWorld(scheduler,accept_fd));
+	client->construct();
+	client.detach();
+}
+
+static void adler32(uint32_t& a,uint32_t& b,const uint8_t* p,size_t len) {
+	while(len) {
+		const size_t n = std::min<size_t>(len,5552); // the most before the sums can overflow
+		for(size_t i=0; i<n; i++) {
+			a += p[i];
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+		p += n;
+		len -= n;
+	}
+}
+
+void UploadHelloWorld::on_body_complete(HttpBody& body) {
+	uint32_t a = 1, b = 0;
+	if(body.in_file()) { // read here for the demo; a real handler would take body.fd, e.g. to a Job
+		uint8_t buf[64*1024];
+		ssize_t len;
+		while(0 < (len = ::read(body.fd,buf,sizeof(buf))))
+			adler32(a,b,buf,len);
+		check(len);
+	} else {
+		iovec iov[16];
+		for(size_t ofs = 0; ofs < body.buf.length(); ) {
+			const int n = body.buf.get_iov(iov,16,ofs);
+			for(int i=0; i<n; i++) {
+				adler32(a,b,reinterpret_cast<const uint8_t*>(iov[i].iov_base),iov[i].iov_len);
+				ofs += iov[i].iov_len;
+			}
+		}
+	}
+	writeHeader("Content-Type","text/plain");
+	writeFormat("Hello World ",body.length," bytes in ",body.in_file()? "file": "memory",
+		" adler32 ",fmt::Hex((b << 16) | a),"\n");
+	finish();
+}
+
+class CoHelloWorld: public CoTask {
+	/* the same hello world written as a coroutine rather than a state machine, for comparing
+	   the two with ./bench; it only understands requests without bodies */
+public:
+	static void factory(Scheduler& scheduler,FD accept_fd);
+private:
+	CoHelloWorld(Scheduler& scheduler,FD accept_fd): CoTask(scheduler), count(0) { fd = accept_fd; }
+	void do_construct();
+	Co main();
+	int count;
+};
+
+void CoHelloWorld::factory(Scheduler& scheduler,FD accept_fd) {
+	Cleanup<CoHelloWorld,CleanupClose> client(new CoHelloWorld(scheduler,accept_fd));
+	client->construct();
+	client.detach();
+}
+
+void CoHelloWorld::do_construct() {
+	check(fd);
+	schedule(EPOLLIN|EPOLLET);
+	setReadAheadBufferSize(1024);
+	setWriteBufferSize(4*1024);
+}
+
+CoTask::Co CoHelloWorld::main() {
+	HttpLine line; // in the frame, which is pooled
+	for(;;) {
+		if(!co_await async_read_line(line))
+			co_return;
+		if(!line.size()) // empty lines are ok before request line
+			continue;
+		const bool http_1_1 = (line.size() > 8) && !strcmp(line.cstr()+line.size()-8,"HTTP/1.1");
+		bool keep_alive = http_1_1;
+		do {
+			if(!co_await async_read_line(line))
+				co_return;
+			if(!strncasecmp(line.cstr(),"connection:",11))
+				keep_alive = !!strcasestr(line.cstr()+11,"keep-alive");
+		} while(line.size());
+		count++;
+		async_printf("HTTP/%s 200 OK\r\nDate: %s\r\nConnection: %s\r\nContent-Length: 18\r\n\r\nHello World %6d",
+			http_1_1?"1.1":"1.0",scheduler.get_http_date(),keep_alive?"keep-alive":"close",count);
+		if(!keep_alive)
+			co_return; // which flushes and closes
+	}
+}
+
 int main(int argc,char* argv[]) {
 	printf(	"\n"
 		"|_  _ || _  _  _ ||   a blazingly-fast async HTTP server written in C++\n"
@@ -47,10 +214,27 @@ int main(int argc,char* argv[]) {
 		"           |          The Simplified BSD License\n"
 		"\n");
 	int port = 42042;
-	bool console = false, timeouts = true, logging = true;
+	const char* address = NULL;
+	bool console = false, timeouts = true, logging = true, coroutines = false, shuffle = false;
+	uint32_t wait = 0;
+	HttpConnectionBase::Spooling spooling = HttpConnectionBase::get_spooling();
+	unsigned spool_threads = 1;
+	bool uploads = false;
+	unsigned listener_flags = 0;
+	uint32_t budget_bytes = 0;
+	uint16_t budget_requests = 0;
+	uint32_t busy_poll = 0;
+	uint32_t max_connections = 0, max_requests = 0, max_lag = 0;
+	unsigned connection_rate[2] = {0,0}, request_rate[2] = {0,0}; // per second, burst
+	HttpConnectionBase::Deadlines deadlines = HttpConnectionBase::get_deadlines();
+	uint32_t reap_connections = 0;
+	size_t reap_buffer_bytes = 0;
 	int opt;
-	while((opt = getopt(argc,argv,"p:chzlr")) != -1) {
+	while((opt = getopt(argc,argv,"p:a:chzlrCb:q:sB:Dm:i:g:K:R:d:I:M:w:u:")) != -1) {
 		switch(opt) {
+		case 'a':
+			address = optarg;
+			break;
 		case 'p':
 			port = atoi(optarg);
 			if(port < 1 || port > 0xffff) {
@@ -67,8 +251,68 @@ int main(int argc,char* argv[]) {
 		case 'l':
 			logging = false;
 			break;
+		case 'C':
+			coroutines = true;
+			break;
+		case 'b':
+			budget_bytes = atoi(optarg);
+			break;
+		case 'q':
+			budget_requests = atoi(optarg);
+			break;
+		case 's':
+			shuffle = true;
+			break;
+		case 'B':
+			busy_poll = atoi(optarg);
+			break;
+		case 'D':
+			listener_flags = Listener::DEFER_ACCEPT|Listener::FASTOPEN;
+			break;
+		case 'm':
+			max_connections = atoi(optarg);
+			break;
+		case 'i':
+			max_requests = atoi(optarg);
+			break;
+		case 'g':
+			max_lag = atoi(optarg);
+			break;
+		case 'K':
+		case 'R': {
+			unsigned* rate = ('K' == opt)? connection_rate: request_rate;
+			if(!sscanf(optarg,"%u:%u",&rate[0],&rate[1]) || !rate[0]) {
+				fprintf(stderr,"-%c expects rate[:burst]\n",opt);
+				return 1;
+			}
+			} break;
+		case 'd':
+			if(4 != sscanf(optarg,"%u:%u:%u:%u",&deadlines.header_millisecs,&deadlines.body_grace_millisecs,
+				&deadlines.body_min_rate,&deadlines.idle_millisecs)) {
+				fprintf(stderr,"-d expects header:body_grace:body_rate:idle\n");
+				return 1;
+			}
+			break;
+		case 'I':
+			reap_connections = atoi(optarg);
+			break;
+		case 'w':
+			wait = atoi(optarg);
+			break;
+		case 'M':
+			reap_buffer_bytes = strtoul(optarg,NULL,10);
+			break;
+		case 'u': {
+			unsigned long long threshold;
+			if(!sscanf(optarg,"%llu:%u",&threshold,&spool_threads)) {
+				fprintf(stderr,"-u expects bytes[:threads]\n");
+				return 1;
+			}
+			spooling.threshold = threshold;
+			uploads = true;
+			} break;
 		case '?':
-			if('p'==optopt)
+			if(strchr("pabqBmigKRdIMwu",optopt))
 				fprintf (stderr,"Option -%c requires an argument.\n",optopt);
 			else if(32 < optopt)
 				fprintf (stderr,"Unknown option `-%c'.\n",optopt);
@@ -79,11 +323,28 @@ int main(int argc,char* argv[]) {
              		fprintf(stderr,"unknown option %c\n",opt);
              		// fall through
              	case 'h':
-			fprintf(stderr,"usage: ./helloworld {-p [port]} {-f [num]} {-c} {-z} {-l}\n"
+			fprintf(stderr,"usage: ./helloworld {-p [port]} {-a [address]} {-f [num]} {-c} {-z} {-l} {-C} {-b [bytes]} {-q [requests]} {-s} {-B [usecs]} {-D} {-m [connections]} {-i [requests]} {-g [millisecs]} {-K [rate:burst]} {-R [rate:burst]}\n"
+				"    {-d [header:body_grace:body_rate:idle]} {-I [connections]} {-M [bytes]} {-w [millisecs]} {-u [bytes:threads]}\n"
+				"  -a listens on an address rather than the port e.g. [::]:80, unix:/tmp/hello or unix:@hello\n"
 				"  -c enables a console (so you can type \"quit\" for a clean shutdown in valgrind)\n"
 				"  -z disables all timeouts (useful for test scripts or debugging clients)\n"
 				"  -l disables logging to file (logging is turned off if running under valgrind)\n"
-				"  -r enables rtmp on port+2 (experimental)\n");
+				"  -r enables rtmp on port+2 (experimental)\n"
+				"  -C serves with the coroutine implementation instead of the state machine\n"
+				"  -b and -q are how many bytes and requests a connection gets per turn before others get theirs\n"
+				"  -s shuffles the order connections get their turns in\n"
+				"  -B busy polls for usecs before sleeping, and asks the kernel to busy poll the sockets too\n"
+				"  -D defers accepting connections until their request arrives, and allows TCP fast open\n"
+				"  -m, -i and -g are admission limits: connections open, requests in flight, and how far behind the loop can get\n"
+				"     before new requests are turned away with a 503\n"
+				"  -K and -R limit each client IP's connections and requests a second, with a burst (default the rate);\n"
+				"     requests over it are held for up to 100ms, then turned away with a 429\n"
+				"  -d sets the ms from a request's first byte to the end of its headers, the ms grace and then bytes a second\n"
+				"     its body must come at, and the ms a connection can wait idle for its next request (default none; e.g. 10000:10000:1024:30000)\n"
+				"  -I and -M close the longest-idle connections whilst more than connections are open or bytes of buffers are in use\n"
+				"  -w defers each response and finishes it from a timer within millisecs, as though waiting on a backend\n"
+				"  -u takes request bodies whole, splicing those over bytes to a file in /tmp on threads (default 1; 0 turns them away),\n"
+				"     and replies with their length and adler32\n");
 			return 0;
 		}
 	}
@@ -91,14 +352,36 @@ int main(int argc,char* argv[]) {
 		if(logging && !RUNNING_ON_VALGRIND)
 			InitLog("helloworld.log");
 		printf("=== Starting HelloWorld ===\n");
+		HelloWorld::headers.add("Server","helloworld").add("Content-Type","text/plain").add("Content-Length","18");
 		Scheduler scheduler;
 		if(!timeouts)
 			scheduler.enable_timeouts(false);
+		scheduler.set_slice_budget(budget_bytes,budget_requests);
+		scheduler.set_shuffle(shuffle);
+		scheduler.set_busy_poll(busy_poll);
+		scheduler.set_socket_busy_poll(busy_poll,true);
+		scheduler.set_admission_limits(max_connections,max_requests,max_lag);
+		scheduler.set_idle_reaping(reap_connections,reap_buffer_bytes);
+		HttpConnectionBase::set_deadlines(deadlines);
+		Cleanup<WorkerPool> spool_pool(spool_threads? new WorkerPool(spool_threads): NULL);
+		spooling.pool = spool_pool.ptr();
+		HttpConnectionBase::set_spooling(spooling);
+		Cleanup<RateLimiter> connection_limit(connection_rate[0]? new RateLimiter(connection_rate[0],
+			connection_rate[1]? connection_rate[1]: connection_rate[0]): NULL);
+		Cleanup<RateLimiter> request_limit(request_rate[0]? new RateLimiter(request_rate[0],
+			request_rate[1]? request_rate[1]: request_rate[0]): NULL);
+		scheduler.set_rate_limits(connection_limit.ptr(),request_limit.ptr(),100);
 		signal(SIGPIPE, SIG_IGN); // Ignoring SIGPIPE for now ??
 		signal(SIGCHLD, SIG_IGN);
 		if(console)
 			Console::create(scheduler);
-		Listener::create(scheduler,"HTTP",port,HelloWorld::factory,100,true);
+		SlowHelloWorld::wait = wait;
+		const Listener::Factory factory = coroutines? CoHelloWorld::factory: wait? SlowHelloWorld::factory:
+			uploads? UploadHelloWorld::factory: HelloWorld::factory;
+		if(address)
+			Listener::create(scheduler,"HTTP",address,factory,100,true,listener_flags);
+		else
+			Listener::create(scheduler,"HTTP",port,factory,100,true,listener_flags);
 		scheduler.run();
 	} catch(Error* e) {
 		e->dump();
@@ -2,218 +2,1096 @@
    Using the Simplified BSD License.  See LICENSE file for details */
 
 #include "http.hpp"
+#include "ratelimit.hpp"
+#include "workers.hpp"
+
+#include <new>
+#include <vector>
 
 extern "C" {
 	#include <string.h>
 	#include <stdlib.h>
 	#include <sys/socket.h>
 	#include <ctype.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <limits.h>
+}
+
+/*** header ids ***/
+
+namespace {
+
+constexpr size_t const_strlen(const char* s) {
+	size_t len = 0;
+	while(s[len]) len++;
+	return len;
 }
 
-/*** HttpServerConnection ***/
+constexpr char fold(char c) {
+	// header names are tokens, so only letters need folding
+	return c + (((unsigned char)(c-'A') < 26u) << 5);
+}
+
+constexpr uint32_t fnv_step(uint32_t h,char c) { return (h ^ (uint8_t)c) * 16777619u; }
+
+struct HeaderName {
+	const char* name;
+	size_t len;
+};
+
+constexpr HeaderName header_names[HDR_COUNT] = {
+#define HTTP_HEADER_NAME(id,name) {name,const_strlen(name)},
+	HTTP_HEADERS(HTTP_HEADER_NAME)
+#undef HTTP_HEADER_NAME
+};
 
-HttpServerConnection::HttpServerConnection(Scheduler& scheduler,FD accept_fd):
-	Task(scheduler), read_state(LINE), write_state(LINE), count(0) {
+struct HeaderHash {
+	/* FNV-1a of the folded name, salted with the first seed that puts every standard header in a
+	   slot of its own; it is searched for by the compiler, so adding a header can't collide */
+	enum { SLOTS = 512, MAX_NAME = 32 };
+	uint32_t seed;
+	uint8_t slots[SLOTS]; // id+1, or 0 for none
+	constexpr HeaderHash(): seed(0), slots() {
+		for(;; seed++) {
+			bool ok = true;
+			for(int i=0; i<SLOTS; i++)
+				slots[i] = 0;
+			for(int id=0; ok && (id<HDR_COUNT); id++) {
+				uint32_t h = 2166136261u ^ seed;
+				for(size_t i=0; i<header_names[id].len; i++)
+					h = fnv_step(h,header_names[id].name[i]);
+				uint8_t& slot = slots[h & (SLOTS-1)];
+				ok = !slot;
+				slot = id+1;
+			}
+			if(ok)
+				return;
+		}
+	}
+};
+
+constexpr HeaderHash header_hash;
+
+static_assert(HDR_COUNT < 255,"header ids are bytes in the hash table");
+
+} // anonymous namespace
+
+HttpHeaderId http_header_id(const char* name,size_t len) {
+	if(len > HeaderHash::MAX_NAME)
+		return HDR_UNKNOWN;
+	// folded and hashed in one pass, then compared with the one name it could be
+	char folded[HeaderHash::MAX_NAME];
+	uint32_t h = 2166136261u ^ header_hash.seed;
+	for(size_t i=0; i<len; i++) {
+		folded[i] = fold(name[i]);
+		h = fnv_step(h,folded[i]);
+	}
+	const int slot = header_hash.slots[h & (HeaderHash::SLOTS-1)];
+	if(!slot)
+		return HDR_UNKNOWN;
+	const HeaderName& candidate = header_names[slot-1];
+	if((candidate.len != len) || memcmp(candidate.name,folded,len))
+		return HDR_UNKNOWN;
+	return static_cast<HttpHeaderId>(slot-1);
+}
+
+const char* http_header_name(HttpHeaderId id) {
+	return (id < HDR_COUNT)? header_names[id].name: NULL;
+}
+
+/*** HttpConnectionBase ***/
+
+class HttpConnectionBase::Spool: public Job {
+	/* a body on its way socket->pipe->file.  The connection splices what has arrived into the
+	   empty pipe, so a splice that would block means the socket is empty rather than the pipe
+	   full, and then run() drains the pipe into the file on a worker; file writes block however
+	   they are made, so the loop never does them.  Whilst it is out on a worker the spool is the
+	   worker's, so a connection that closes meanwhile abandons it, and it deletes itself once it
+	   is back */
+public:
+	explicit Spool(HttpConnectionBase& c): connection(c), file(-1), pipe_size(0), in_pipe(0), length(0),
+		sent(0), failed(NULL), error(0), out(false), abandoned(false) { pipe[0] = pipe[1] = -1; }
+	bool open(const char* dir);
+	bool fill(const void* ptr,size_t len); // with what was read ahead with the headers; the pipe must be empty and len at most pipe_size
+	bool drain();
+	void give_up(); // tells the client its body was lost
+	void abandon();
+	enum { PIPE_SIZE = 1024*1024 }; // asked for; the kernel's limits have the final say
+	HttpConnectionBase& connection;
+	FD pipe[2], file;
+	size_t pipe_size, in_pipe;
+	uint64_t length; // in the file
+	time64_t sent; // to the worker
+	const char* failed; // what
+	int error;
+	bool out; // on a worker
+	bool abandoned;
+private:
+	~Spool();
+	void run();
+	void done();
+	void release();
+};
+
+HttpConnectionBase::HttpConnectionBase(Scheduler& scheduler,FD accept_fd):
+	Task(scheduler), uri(""), read_state(LINE), write_state(LINE), scratch(NULL), in_flight(false),
+	pending_head(NULL), pending_tail(NULL), current(NULL), pending(0), phase(PHASE_BUSY), count(0) {
 	fd = accept_fd;
 }
 
-void HttpServerConnection::do_construct() {
+HttpConnectionBase::~HttpConnectionBase() {
+	end_request();
+	release_scratch();
+	while(HttpResponse* response = pending_head) {
+		pending_head = response->next;
+		delete response;
+	}
+}
+
+void HttpConnectionBase::do_construct() {
 	check(fd);
 	schedule(EPOLLIN|EPOLLET);
-	setReadAheadBufferSize(sizeof(line));
+	setReadAheadBufferSize(sizeof(Scratch::line));
 	setWriteBufferSize(4*1024);
+	setWriteWatermarks(64*1024,16*1024); // stop reading pipelined requests for a client that isn't reading the responses
+	await_request();
 }
 
-void HttpServerConnection::dump_context(FILE* out) const {
+void HttpConnectionBase::dump_context(FILE* out) const {
 	Task::dump_context(out);
 	if(uri[0])
 		fprintf(out,"[%s] ",uri);
 }
 
-void HttpServerConnection::read() {
-	while(!is_closed()) {
-		switch(read_state) {
-		case LINE:
+HttpConnectionBase::Scratch& HttpConnectionBase::get_scratch() {
+	if(!scratch) {
+		scratch = new(scheduler.get_buffers().alloc(sizeof(Scratch))) Scratch(*this);
+		scratch->uri[0] = '\0';
+	}
+	return *scratch;
+}
+
+void HttpConnectionBase::release_scratch() {
+	if(scratch) {
+		release_body();
+		if(scratch->spool)
+			scratch->spool->abandon();
+		scratch->~Scratch();
+		scheduler.get_buffers().release(scratch,sizeof(Scratch));
+		scratch = NULL;
+		uri = "";
+	}
+}
+
+const char* HttpConnectionBase::read_request_line() {
+	if(pending >= MAX_PENDING) {
+		defer_input(); // until send_pending() has sent some
+		return NULL;
+	}
+	HttpLine& line = get_scratch().line;
+	if(scratch->held) {
+		if(scratch->hold.is_pending()) {
+			defer_input(); // rate limited; the timer makes us ready when its token is due
+			return NULL;
+		}
+		scratch->held = false;
+	} else {
+		for(;;) {
 			// get the request line
-			try {
-				if(!async_read_in(line,sizeof(uri)-1))
-					return;
-			} catch(EndOfStreamError*) {
-				if(!count)
-					throw;
-				// so we get end-of-stream when keep-alive?  no problem
-				return;
+			switch(try_read_in(line,sizeof(scratch->uri)-1)) {
+			case IO_OK: break;
+			case IO_AGAIN:
+				if(line.size())
+					start_request();
+				else if(LINE == write_state)
+					release_scratch(); // idle
+				return NULL;
+			case IO_EOS: // so we get end-of-stream when keep-alive?  no problem
+				close();
+				return NULL;
 			}
-			if(!line.ends_with("\r\n",2))
-				HttpError::Throw(HttpError::ERequestURITooLong,*this);
-			if(!memcmp(line.cstr(),"\r\n",3)) { // empty lines are ok before request line
-				line.clear();
-				continue;
-			}
-			count++;
-			read_state = HEADER;
-			{
-				const char* method = strtok(line.cstr()," ");
-				strncpy(uri,strtok(NULL," \r"),sizeof(this->uri));
-				const char* v = strtok(NULL,"\r");
-				if(!memcmp(v,"HTTP/1.1",9))
-					version = HTTP_1_1;
-				else if(!memcmp(v,"HTTP/1.0",9))
-					version = HTTP_1_0;
-				else
-					version = HTTP_0_9;
-				in_encoding_chunked = false;
-				in_content_length = -1; // not known
-				keep_alive = out_encoding_chunked = (HTTP_1_1 == version);
-				on_request(method,uri);
+			if(!line.ends_with("\r\n",2)) {
+				HttpError::Send(HttpError::ERequestURITooLong,*this);
+				return NULL;
 			}
-			line.clear();
-			break;
-		case HEADER:
-			if(!async_read_in(line))
-				return;
-			if(!memcmp("\r\n",line.cstr(),3)) {
-				read_state = BODY;
-				if(keep_alive && !in_encoding_chunked && (-1 == in_content_length))
-					in_content_length = 0; // length isn't specified, yet its keep-alive, so there is no content
-				line.clear();
-				on_body();
+			if(memcmp(line.cstr(),"\r\n",3))
 				break;
+			line.clear(); // empty lines are ok before request line
+		}
+		start_request();
+		if(!take_rate_token())
+			return NULL;
+	}
+	if(!in_flight) {
+		if(!scheduler.admit_request()) {
+			shed();
+			return NULL;
+		}
+		in_flight = true;
+	}
+	count++;
+	read_state = HEADER;
+	const char* method = strtok(line.cstr()," ");
+	strncpy(scratch->uri,strtok(NULL," \r"),sizeof(scratch->uri));
+	uri = scratch->uri;
+	const char* v = strtok(NULL,"\r");
+	if(!memcmp(v,"HTTP/1.1",9))
+		version = HTTP_1_1;
+	else if(!memcmp(v,"HTTP/1.0",9))
+		version = HTTP_1_0;
+	else
+		version = HTTP_0_9;
+	in_encoding_chunked = false;
+	in_content_length = -1; // not known
+	scratch->headers.clear();
+	keep_alive = out_encoding_chunked = (HTTP_1_1 == version);
+	return method;
+}
+
+bool HttpConnectionBase::read_header(HttpHeaderId& id,const char*& header,const char*& value) {
+	HttpLine& line = get_scratch().line;
+	switch(try_read_in(line)) {
+	case IO_OK: break;
+	case IO_AGAIN: return false;
+	case IO_EOS:
+		if(Log(LOG_CONN)) {
+			dump_context(stdout);
+			fprintf(stdout,"end of stream in headers\n");
+		}
+		close();
+		return false;
+	}
+	if(!memcmp("\r\n",line.cstr(),3)) {
+		read_state = BODY;
+		if(keep_alive && !in_encoding_chunked && (-1 == in_content_length))
+			in_content_length = 0; // length isn't specified, yet its keep-alive, so there is no content
+		if(in_encoding_chunked || (0 < in_content_length))
+			start_body();
+		else
+			busy(); // a body that runs until the client closes is the handler's to police
+		line.clear();
+		id = HDR_UNKNOWN;
+		header = value = NULL;
+		return true;
+	}
+	if(!line.ends_with("\r\n",2)) {
+		HttpError::Send(HttpError::ERequestEntityTooLarge,*this);
+		return false;
+	}
+	// name:[whitespace]value[whitespace]\r\n
+	char* name = line.cstr();
+	const char* colon = strchr(name,':');
+	if(!colon || (colon == name) || memchr(name,' ',colon-name)) {
+		HttpError::Send(HttpError::EBadRequest,*this);
+		return false;
+	}
+	const char* v = colon+1;
+	while((' ' == *v) || ('\t' == *v))
+		v++;
+	const char* end = v+strcspn(v,"\r");
+	while((end > v) && ((' ' == end[-1]) || ('\t' == end[-1])))
+		end--;
+	id = http_header_id(name,colon-name);
+	Headers& headers = scratch->headers;
+	if(!(value = headers.add(v,end-v))) {
+		HttpError::Send(HttpError::ERequestEntityTooLarge,*this);
+		return false;
+	}
+	name[colon-name+1] = '\0'; // the value is copied; leave the name as it came in, for raw_header_name()
+	if((HDR_UNKNOWN != id) && !headers.known[id]) {
+		headers.known[id] = value-headers.store+1;
+		header = header_names[id].name;
+	} else if(!(header = headers.add(name,colon-name)) || (Headers::MAX_OTHER == headers.other_count)) {
+		HttpError::Send(HttpError::ERequestEntityTooLarge,*this);
+		return false;
+	} else {
+		Headers::Other& other = headers.other[headers.other_count++];
+		other.name = header-headers.store;
+		other.value = value-headers.store;
+	}
+	switch(id) {
+	case HDR_CONNECTION:
+		if((write_state == LINE) && !strcasecmp(value,"keep-alive"))
+			keep_alive = true;
+		else if(!strcasecmp(value,"close"))
+			keep_alive = false;
+		break;
+	case HDR_CONTENT_LENGTH: {
+		// just digits, and a repeat must agree, else the length is ambiguous (RFC7230-s3.3.2)
+		char* end;
+		errno = 0;
+		const int64_t len = strtoll(value,&end,10); // 64-bit, for multi-GB uploads
+		if(!isdigit((unsigned char)*value) || *end || errno ||
+			((-1 != in_content_length) && (len != in_content_length))) {
+			HttpError::Send(HttpError::EBadRequest,*this);
+			return false;
+		}
+		in_content_length = len;
+		} break;
+	case HDR_TRANSFER_ENCODING:
+		in_encoding_chunked = !strcasecmp(value,"chunked");
+		break;
+	default:;
+	}
+	return true;
+}
+
+void HttpConnectionBase::Headers::clear() {
+	memset(known,0,sizeof(known));
+	other_count = used = 0;
+}
+
+const char* HttpConnectionBase::Headers::add(const char* str,size_t len) {
+	if(len >= (size_t)(STORE-used))
+		return NULL;
+	char* dest = store+used;
+	memcpy(dest,str,len);
+	dest[len] = '\0';
+	used += len+1;
+	return dest;
+}
+
+const char* HttpConnectionBase::get_header(HttpHeaderId id) const {
+	if(!scratch || (id >= HDR_COUNT) || !scratch->headers.known[id])
+		return NULL;
+	return scratch->headers.store+scratch->headers.known[id]-1;
+}
+
+const char* HttpConnectionBase::raw_header_name() const {
+	return scratch? scratch->line.cstr(): NULL;
+}
+
+const char* HttpConnectionBase::get_header(const char* name) const {
+	const HttpHeaderId id = http_header_id(name,strlen(name));
+	if((HDR_UNKNOWN != id) || !scratch)
+		return get_header(id);
+	const Headers& headers = scratch->headers;
+	for(size_t i=0; i<headers.other_count; i++)
+		if(!strcasecmp(headers.store+headers.other[i].name,name))
+			return headers.store+headers.other[i].value;
+	return NULL;
+}
+
+size_t HttpConnectionBase::get_other_header_count() const {
+	return scratch? scratch->headers.other_count: 0;
+}
+
+void HttpConnectionBase::get_other_header(size_t i,const char*& name,const char*& value) const {
+	if(i >= get_other_header_count())
+		ThrowInternalError("there are only %zu other headers",get_other_header_count());
+	const Headers& headers = scratch->headers;
+	name = headers.store+headers.other[i].name;
+	value = headers.store+headers.other[i].value;
+}
+
+void HttpConnectionBase::next_line() {
+	if(scratch)
+		scratch->line.clear();
+}
+
+bool HttpConnectionBase::read_body(uint8_t*& chunk,uint16_t& len) {
+	if(in_encoding_chunked) { //RFC2616-s4.4 says this overrides any explicit content-length header
+		ThrowInternalError("in encoding chunked not implemented yet");
+	} else if(!keep_alive && (-1 == in_content_length)) {
+		// read all available
+		const IoStatus status = try_read_buffered(chunk,len);
+		if(IO_EOS == status) // the body ends when the client closes its side
+			graceful_close();
+		return (IO_OK == status);
+	} else if(-1 != in_content_length) {
+		// read all available
+		if(in_content_length) {
+			const IoStatus status = try_read_buffered(chunk,len,std::min<int64_t>(in_content_length,UINT16_MAX)); // not truncated to 0 at 64KB
+			if(IO_OK != status) {
+				if(IO_EOS == status)
+					close();
+				return false;
 			}
-			if(!line.ends_with("\r\n",2))
-				HttpError::Throw(HttpError::ERequestEntityTooLarge,*this);
-			{
-				const char* header = strtok(line.cstr()," "), *value = strtok(NULL,"\r");
-				if(!ends_with(header,":",1))
-					HttpError::Throw(HttpError::EBadRequest,*this);
-				if((write_state == LINE) && !strcasecmp(header,"connection:") && !strcasecmp(value,"keep-alive"))
-					keep_alive = true;
-				else if(!strcasecmp(header,"content-length:")) {
-					in_content_length = atoi(value);
-					if(in_content_length < 0)
-						HttpError::Throw(HttpError::EBadRequest,*this);
-				} else if(!strcasecmp(header,"transfer-encoding:"))
-					in_encoding_chunked = !strcasecmp(value,"chunked");
-				on_header(header,value);
+			in_content_length -= len;
+			body_progress(len);
+			return true;
+		}
+		end_body();
+	} else
+		ThrowInternalError("cannot cope with combination of keep_alive %d, content_length %" PRId64 " and encoding_chunked %d",
+			keep_alive,in_content_length,in_encoding_chunked);
+	return false;
+}
+
+void HttpConnectionBase::end_body() {
+	if(in_flight)
+		busy();
+	else
+		await_request(); // the response went before the body was all in
+	if(!keep_alive) {
+		read_state = FINISHED;
+		shutdown(fd,SHUT_RD);
+	} else
+		read_state = LINE;
+}
+
+HttpConnectionBase::Spool::~Spool() {
+	if(-1 != file)
+		::close(file);
+	for(int i=0; i<2; i++)
+		if(-1 != pipe[i])
+			::close(pipe[i]);
+}
+
+bool HttpConnectionBase::Spool::open(const char* dir) {
+	file = ::open(dir,O_TMPFILE|O_RDWR|O_CLOEXEC,0600);
+	if((0 > file) && ((EOPNOTSUPP == errno) || (EISDIR == errno))) { // a filesystem or kernel without O_TMPFILE
+		char path[PATH_MAX];
+		snprintf(path,sizeof(path),"%s/body.XXXXXX",dir);
+		file = mkostemp(path,O_CLOEXEC);
+		if(0 <= file)
+			unlink(path);
+	}
+	if(0 > file) {
+		failed = dir;
+		error = errno;
+		return false;
+	}
+	if(pipe2(pipe,O_CLOEXEC)) {
+		failed = "pipe2()";
+		error = errno;
+		return false;
+	}
+	// the loop writes the write end, so it must never block there; whatever its size turns out to be
+	if(fcntl(pipe[1],F_SETFL,O_NONBLOCK)) {
+		failed = "fcntl()";
+		error = errno;
+		return false;
+	}
+	fcntl(pipe[1],F_SETPIPE_SZ,PIPE_SIZE); // fewer syscalls a body, if allowed; over the user's pipe page limit, a pipe can be a single page
+	const int size = fcntl(pipe[1],F_GETPIPE_SZ);
+	pipe_size = (0 < size)? size: PIPE_BUF;
+	return true;
+}
+
+bool HttpConnectionBase::Spool::fill(const void* ptr,size_t len) {
+	// no more than pipe_size, which an empty pipe has room for; were it short, the write fails rather than blocks
+	const ssize_t ret = ::write(pipe[1],ptr,len);
+	if(ret != (ssize_t)len) {
+		failed = "write()";
+		error = (0 > ret)? errno: EAGAIN;
+		return false;
+	}
+	in_pipe = len;
+	return true;
+}
+
+bool HttpConnectionBase::Spool::drain() {
+	// an explicit offset leaves the file's own at 0, for the handler
+	while(in_pipe) {
+		loff_t ofs = length;
+		const ssize_t ret = splice(pipe[0],NULL,file,&ofs,in_pipe,SPLICE_F_MOVE);
+		if(0 >= ret) {
+			if((0 > ret) && (EINTR == errno))
+				continue;
+			failed = "splice()";
+			error = ret? errno: EIO;
+			return false;
+		}
+		in_pipe -= ret;
+		length += ret;
+	}
+	return true;
+}
+
+void HttpConnectionBase::Spool::give_up() {
+	connection.dump_context(stderr);
+	fprintf(stderr,"cannot spool body: %s: %s\n",failed,strerror(error));
+	HttpError::Send(HttpError::EInternalServerError,connection);
+}
+
+void HttpConnectionBase::Spool::abandon() {
+	if(out)
+		abandoned = true;
+	else
+		delete this;
+}
+
+void HttpConnectionBase::Spool::run() {
+	drain();
+}
+
+void HttpConnectionBase::Spool::done() {
+	connection.spooled();
+}
+
+void HttpConnectionBase::Spool::release() {
+	// back, whether delivered or not
+	out = false;
+	if(abandoned)
+		delete this;
+}
+
+HttpBody* HttpConnectionBase::collect_body() {
+	if(in_encoding_chunked)
+		ThrowInternalError("in encoding chunked not implemented yet");
+	HttpBody& body = scratch->body;
+	if(-1 == in_content_length) // a request without a length has no body (RFC7230 s3.3.3)
+		end_body();
+	else if(scratch->spool || ((uint64_t)in_content_length > spooling.threshold)) {
+		if(!spool_body())
+			return NULL;
+	} else {
+		uint8_t* chunk;
+		uint16_t len;
+		while(read_body(chunk,len))
+			body.buf.append(chunk,len);
+		if(BODY == read_state)
+			return NULL;
+		body.length = body.buf.length();
+	}
+	return &body;
+}
+
+bool HttpConnectionBase::spool_body() {
+	if(!scratch->spool) {
+		if(!spooling.pool) { // writing the file on the loop would stall every connection whenever the disk did
+			HttpError::Send(HttpError::ERequestEntityTooLarge,*this);
+			return false;
+		}
+		scratch->spool = new Spool(*this);
+		if(!scratch->spool->open(spooling.dir)) {
+			scratch->spool->give_up();
+			return false;
+		}
+	}
+	Spool& spool = *scratch->spool;
+	if(spool.out) { // the disk is behind; spooled() picks up from here
+		defer_input();
+		return false;
+	}
+	if(in_content_length) {
+		if(const uint16_t ahead = get_read_ahead()) { // what came in with the headers goes first
+			uint8_t* chunk;
+			uint16_t len;
+			// what the pipe can't take stays read ahead for the next round
+			try_read_buffered(chunk,len,std::min<int64_t>(in_content_length,std::min<size_t>(ahead,spool.pipe_size)));
+			if(!spool.fill(chunk,len)) {
+				spool.give_up();
+				return false;
 			}
-			line.clear();
-			break;
-		case BODY:
-			if(in_encoding_chunked) { //RFC2616-s4.4 says this overrides any explicit content-length header
-				ThrowInternalError("in encoding chunked not implemented yet");
-			} else if(!keep_alive && (-1 == in_content_length)) {
-				// read all available
-				uint8_t* chunk;
-				while(uint16_t len = async_read_buffered(chunk))
-					on_data(chunk,len);
-			} else if(-1 != in_content_length) {
-				// read all available
-				while(in_content_length) {
-					uint8_t* chunk;
-					if(const uint16_t len = async_read_buffered(chunk,in_content_length)) {
-						in_content_length -= len;
-						on_data(chunk,len);
-					} else
-						return;
-				}
-				if(!keep_alive) {
-					read_state = FINISHED;
-					shutdown(fd,SHUT_RD);
-					return;
-				}
-				read_state = LINE;
-			} else
-				ThrowInternalError("cannot cope with combination of keep_alive %d, content_length %d and encoding_chunked %d",
-					keep_alive,in_content_length,in_encoding_chunked);
-			break;
-		default:
-			ThrowInternalError("unexpected read_state");
+		} else switch(try_splice_in(spool.pipe[1],std::min<uint64_t>(in_content_length,spool.pipe_size),spool.in_pipe)) {
+		case IO_OK: break;
+		case IO_AGAIN: return false;
+		case IO_EOS:
+			close();
+			return false;
 		}
+		in_content_length -= spool.in_pipe;
+		body_progress(spool.in_pipe);
+		// stop reading until the pipe is drained, so memory is bounded by the pipe however slow the disk
+		spool.out = true;
+		spool.sent = scheduler.get_now();
+		set_deadline(0); // the client isn't to blame for the disk
+		unschedule(EPOLLIN);
+		defer_input();
+		offload(*spooling.pool,&spool);
+		return false;
+	}
+	HttpBody& body = scratch->body;
+	body.length = spool.length;
+	body.fd = spool.file;
+	spool.file = -1;
+	spool.abandon();
+	scratch->spool = NULL;
+	end_body();
+	return true;
+}
+
+void HttpConnectionBase::spooled() {
+	if(is_closed())
+		return;
+	Spool& spool = *scratch->spool;
+	if(spool.error) {
+		spool.give_up();
+		return;
+	}
+	schedule(EPOLLIN);
+	scratch->body_start += scheduler.get_now()-spool.sent; // the wait on the disk doesn't count against the client
+	body_progress(0);
+	yield(); // what arrived meanwhile won't be edge-triggered again
+}
+
+void HttpConnectionBase::release_body() {
+	HttpBody& body = scratch->body;
+	if(-1 != body.fd) {
+		::close(body.fd);
+		body.fd = -1;
+	}
+	body.buf.clear();
+	body.length = 0;
+}
+
+/* every status line, for each version and connection mode, serialized up front along with its
+   Connection header; Transfer-Encoding is left to finishHeader(), as a Content-Length header
+   may yet make it unnecessary */
+static const struct {
+	int code;
+	const char* message;
+} status_messages[] = {
+	{100,"Continue"},{101,"Switching Protocols"},
+	{200,"OK"},{201,"Created"},{202,"Accepted"},{204,"No Content"},{206,"Partial Content"},
+	{301,"Moved Permanently"},{302,"Found"},{303,"See Other"},{304,"Not Modified"},
+	{307,"Temporary Redirect"},{308,"Permanent Redirect"},
+	{400,"Bad Request"},{401,"Unauthorized"},{403,"Forbidden"},{404,"Not Found"},
+	{405,"Method Not Allowed"},{408,"Request Timeout"},{411,"Length Required"},
+	{412,"Precondition Failed"},{413,"Request Entity Too Large"},{414,"Request-URI Too Long"},
+	{415,"Unsupported Media Type"},{429,"Too Many Requests"},
+	{500,"Internal Server Error"},{501,"Not Implemented"},{502,"Bad Gateway"},
+	{503,"Service Unavailable"},{504,"Gateway Timeout"},{505,"HTTP Version Not Supported"},
+};
+
+class StatusLines {
+public:
+	StatusLines();
+	~StatusLines();
+	const fmt::Str* get(int code,const char* message,bool http_1_1,bool keep_alive) const;
+private:
+	enum { CODES = sizeof(status_messages)/sizeof(*status_messages), MAX_CODE = 600 };
+	int8_t index[MAX_CODE]; // into status_messages, or -1
+	std::vector<fmt::Str> lines; // [code][http_1_1][keep_alive]
+	char* text;
+};
+
+StatusLines::StatusLines() {
+	memset(index,-1,sizeof(index));
+	size_t len = 0;
+	for(int i=0; i<CODES; i++) {
+		index[status_messages[i].code] = i;
+		len += 4 * (strlen("HTTP/1.x 999 \r\nConnection: keep-alive\r\n") + strlen(status_messages[i].message));
 	}
+	char* c = text = new char[len+1];
+	lines.reserve(CODES*4);
+	for(int i=0; i<CODES; i++)
+		for(int v=0; v<2; v++)
+			for(int k=0; k<2; k++) {
+				const int n = sprintf(c,"HTTP/1.%d %d %s\r\nConnection: %s\r\n",v,status_messages[i].code,
+					status_messages[i].message,k? "keep-alive": "close");
+				lines.push_back(fmt::Str(c,n));
+				c += n;
+			}
+	assert(c <= text+len);
 }
 
-void HttpServerConnection::writeResponseCode(int code,const char* message) {
+StatusLines::~StatusLines() {
+	delete[] text;
+}
+
+const fmt::Str* StatusLines::get(int code,const char* message,bool http_1_1,bool keep_alive) const {
+	if((0 > code) || (MAX_CODE <= code) || (0 > index[code]))
+		return NULL;
+	const int i = index[code];
+	if((message != status_messages[i].message) && strcmp(message,status_messages[i].message))
+		return NULL; // a message of the handler's own
+	return &lines[i*4+(http_1_1? 2: 0)+(keep_alive? 1: 0)];
+}
+
+static const StatusLines status_lines;
+
+template<typename... Args> void HttpConnectionBase::emit_format(const Args&... args) {
+	if(pending_head)
+		buffered().buf.format(args...);
+	else
+		async_format(args...);
+}
+
+void HttpConnectionBase::writeResponseCode(int code,const char* message) {
 	if(write_state != LINE)
 		ThrowInternalError("cannot write response code");
 	write_state = HEADER;
-	async_printf("HTTP/%s %d %s\r\nConnection: %s\r\n%s",(version==HTTP_1_1?"1.1":"1.0"),code,message,
-		keep_alive?"keep-alive":"close",out_encoding_chunked?"Transfer-Encoding: chunked\r\n":"");
+	const fmt::Str date(scheduler.get_http_date(),HTTP_DATE_LEN);
+	if(const fmt::Str* line = status_lines.get(code,message,HTTP_1_1 == version,keep_alive))
+		emit_format(*line,"Date: ",date,"\r\n");
+	else
+		emit_format((version==HTTP_1_1)? "HTTP/1.1 ": "HTTP/1.0 ",code,' ',message,"\r\nDate: ",date,
+			keep_alive? "\r\nConnection: keep-alive\r\n": "\r\nConnection: close\r\n");
 }
 
-void HttpServerConnection::writeHeader(const char* header,const char* value) {
+void HttpConnectionBase::writeHeader(const char* header,const char* value) {
 	if(write_state == LINE)
 		writeResponseCode(200,"OK");
 	else if(write_state != HEADER) // could keep a chain to write after the body if chunk encoded
 		ThrowInternalError("cannot write response code");
-	async_printf("%s: %s\r\n",header,value);
+	if(out_encoding_chunked && !strcasecmp(header,"Content-Length"))
+		out_encoding_chunked = false;
+	emit_format(header,": ",value,"\r\n");
 }
 
-void HttpServerConnection::finishHeader() {
+void HttpConnectionBase::writeHeaders(const HttpHeaderBlock& headers) {
+	if(write_state == LINE)
+		writeResponseCode(200,"OK");
+	else if(write_state != HEADER)
+		ThrowInternalError("cannot write headers");
+	if(headers.has_content_length())
+		out_encoding_chunked = false;
+	emit_const(headers.data(),headers.length());
+}
+
+void HttpConnectionBase::finishHeader() {
 	if(write_state == LINE || write_state == HEADER) {
 		if(write_state == LINE)
 			writeResponseCode(200,"OK");
 		if(!out_encoding_chunked)
-			async_write("\r\n");
+			emit_const("\r\n");
+		else
+			emit_const("Transfer-Encoding: chunked\r\n"); // the first chunk's length is preceded by \r\n
 		write_state = BODY;
 	} else if(write_state != BODY)
 		ThrowInternalError("connection not ready for body");
 }
 
-void HttpServerConnection::write(const void* ptr,size_t len) {
+void HttpConnectionBase::write(const void* ptr,size_t len) {
 	if(!len) return;
 	finishHeader();
 	if(out_encoding_chunked)
-		async_printf("\r\n%zx\r\n",len);
-	async_write_cpy(ptr,len);
+		emit_format("\r\n",fmt::Hex(len),"\r\n");
+	emit(ptr,len);
 }
 
-void HttpServerConnection::write(const char* str) {
+void HttpConnectionBase::write(const char* str) {
 	write(str,strlen(str));
 }
 
-void HttpServerConnection::writef(const char* fmt,...) {
+void HttpConnectionBase::writef(const char* fmt,...) {
 	va_list ap;
 	va_start(ap,fmt);
 	char buf[1024];
-	int len = vsnprintf(buf,sizeof(buf),fmt,ap);
-	if(!len) return;
+	va_list copy;
+	va_copy(copy,ap);
+	int len = vsnprintf(buf,sizeof(buf),fmt,copy);
+	va_end(copy);
 	check(len);
-	if(len == sizeof(buf)) { // overflowed?
+	if(len >= (int)sizeof(buf)) { // overflowed?
 		char* s;
 		len = vasprintf(&s,fmt,ap);
+		va_end(ap);
 		check(len);
-		write(s,len);
-	} else
+		try {
+			write(s,len);
+		} catch(...) {
+			free(s);
+			throw;
+		}
+		free(s);
+	} else {
+		va_end(ap);
 		write(buf,len);
-	va_end(ap);
+	}
 }
 
-void HttpServerConnection::disconnected() {
+void HttpConnectionBase::disconnected() {
 	if(!(keep_alive && write_state == LINE))
 		ThrowClientError("disconnected");
 }
 
-void HttpServerConnection::finish() {
+void HttpConnectionBase::finish() {
 	finishHeader();
 	if(out_encoding_chunked) // finish chunk
-		async_write("\r\n0\r\n\r\n");
-	async_write_buffered();
+		emit_const("\r\n0\r\n\r\n");
+	end_request();
+	if(current) { // behind deferred responses, so send_pending() sends it in its turn
+		current->finished = true;
+		current->keep_alive = keep_alive;
+		current = NULL;
+	} else
+		async_write_buffered();
 	if(keep_alive) {
 		write_state = LINE;
-		set_nodelay(true); // flushes it
-		set_nodelay(false);
+		if(!pending_head) {
+			set_nodelay(true); // flushes it
+			set_nodelay(false);
+		}
+		if(LINE == read_state) // else when the body is all in
+			await_request();
 	} else
 		gracefulClose();
 }
 
-void HttpServerConnection::gracefulClose(const char* reason) {
-	if(out) {
-		half_close = reason? reason: "";
+void HttpConnectionBase::gracefulClose(const char* reason) {
+	end_request();
+	set_idle(false); // any deadline stands, so a client that won't take the last of its output still goes
+	write_state = FINISHED;
+	if(pending_head) { // once the deferred responses ahead have gone; see send_pending()
+		HttpResponse& last = buffered();
+		last.finished = true;
+		last.keep_alive = false;
+		current = NULL;
+		read_state = FINISHED;
+		defer_input(); // what else the client sent is left unread
+		busy(); // waiting on the handler, not the client
+		return;
+	}
+	graceful_close(reason);
+}
+
+HttpResponse* HttpConnectionBase::defer() {
+	if(!in_flight || (HEADER == read_state) || (FINISHED == write_state))
+		ThrowInternalError("no request whose response can be deferred");
+	HttpResponse& response = buffered();
+	response.version = version;
+	response.keep_alive = keep_alive;
+	response.out_encoding_chunked = out_encoding_chunked;
+	response.write_state = write_state;
+	response.in_flight = true; // the admission goes with it
+	in_flight = false;
+	current = NULL;
+	write_state = LINE;
+	return &response;
+}
+
+HttpResponse& HttpConnectionBase::buffered() {
+	if(!current) {
+		current = new HttpResponse(*this);
+		if(pending_tail)
+			pending_tail->next = current;
+		else
+			pending_head = current;
+		pending_tail = current;
+		pending++;
+	}
+	return *current;
+}
+
+void HttpConnectionBase::send_pending() {
+	bool sent = false;
+	while(HttpResponse* response = pending_head) {
+		if(!response->buf.empty()) {
+			async_write(new OutIOBuf(response->buf)); // shares its segments
+			response->buf.clear();
+			sent = true;
+		}
+		if(!response->finished && (response != current))
+			break; // the rest goes as it is written
+		pending_head = response->next;
+		if(!pending_head)
+			pending_tail = NULL;
+		pending--;
+		if(response == current) { // at the front, so the rest of it can go straight out
+			current = NULL;
+			delete response;
+			break;
+		}
+		const bool last = !response->keep_alive;
+		delete response;
+		if(last) {
+			graceful_close();
+			return;
+		}
+	}
+	if(sent) {
+		set_nodelay(true); // flushes it
+		set_nodelay(false);
+	}
+	if(!pending_head && (LINE == read_state) && (LINE == write_state) && !in_flight)
+		await_request();
+}
+
+void HttpConnectionBase::emit(const void* ptr,size_t len) {
+	if(pending_head)
+		buffered().buf.append(ptr,len);
+	else
+		async_write_cpy(ptr,len);
+}
+
+void HttpConnectionBase::emit_const(const void* ptr,size_t len) {
+	if(pending_head)
+		buffered().buf.append(ptr,len);
+	else
+		async_write(ptr,len);
+}
+
+void HttpConnectionBase::emit_const(const char* str) {
+	emit_const(str,strlen(str));
+}
+
+HttpConnectionBase::Deadlines HttpConnectionBase::deadlines = {0,0,0,0}; // none, as before there were any
+
+void HttpConnectionBase::set_deadlines(const Deadlines& d) {
+	deadlines = d;
+}
+
+HttpConnectionBase::Spooling HttpConnectionBase::spooling = {64*1024,"/tmp",NULL};
+
+void HttpConnectionBase::set_spooling(const Spooling& s) {
+	spooling = s;
+}
+
+void HttpConnectionBase::await_request() {
+	if(get_bytes_queued() || pending_head) {
+		busy(); // not idle until the responses have gone; see drained() and send_pending()
+		return;
+	}
+	phase = PHASE_IDLE;
+	set_deadline(deadlines.idle_millisecs? scheduler.get_now()+millisecs_to_time64(deadlines.idle_millisecs): 0);
+	set_idle(true);
+}
+
+void HttpConnectionBase::start_request() {
+	if(PHASE_HEADERS == phase)
+		return;
+	phase = PHASE_HEADERS;
+	set_idle(false);
+	set_deadline(deadlines.header_millisecs? scheduler.get_now()+millisecs_to_time64(deadlines.header_millisecs): 0);
+}
+
+void HttpConnectionBase::start_body() {
+	phase = PHASE_BODY;
+	scratch->body_start = scheduler.get_now();
+	scratch->body_read = 0;
+	body_progress(0);
+}
+
+void HttpConnectionBase::body_progress(size_t len) {
+	// each byte earns the client more time, so only the average rate matters; the deadline only moves later, so the timer isn't touched
+	if(PHASE_BODY != phase)
+		return;
+	scratch->body_read += len;
+	if(!deadlines.body_min_rate) {
+		set_deadline(0);
+		return;
+	}
+	set_deadline(scratch->body_start + millisecs_to_time64(deadlines.body_grace_millisecs) +
+		microsecs_to_time64(scratch->body_read*1000000/deadlines.body_min_rate));
+}
+
+void HttpConnectionBase::busy() {
+	if(PHASE_BUSY == phase)
+		return;
+	phase = PHASE_BUSY;
+	set_deadline(0);
+}
+
+void HttpConnectionBase::drained() {
+	if((PHASE_BUSY == phase) && !in_flight && (LINE == write_state))
+		await_request();
+}
+
+void HttpConnectionBase::shed() {
+	// static, so turning a request away under load costs no more than a memcpy
+	static const char response[] =
+		"HTTP/1.1 503 Service Unavailable\r\n"
+		"Retry-After: 1\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: close\r\n"
+		"\r\n";
+	emit_const(response,sizeof(response)-1);
+	gracefulClose("shed");
+}
+
+bool HttpConnectionBase::take_rate_token() {
+	RateLimiter* rate_limit = scheduler.get_request_rate_limit();
+	if(!rate_limit || !get_peer().is_set())
+		return true;
+	const time64_t max_delay = scheduler.get_rate_limit_max_delay();
+	const time64_t wait = rate_limit->take(get_peer(),scheduler.get_now(),max_delay);
+	if(!wait)
+		return true;
+	if(wait <= max_delay) { // its token is reserved; hold the line until then
+		scratch->held = true;
+		defer_input();
+		scheduler.call_later(&scratch->hold,time64_to_millisecs(wait+millisecs_to_time64(1)-1));
 	} else {
-		shutdown(fd,SHUT_RD);
-		close();
+		const uint64_t secs = (time64_to_millisecs64(wait)+999)/1000;
+		emit_format("HTTP/1.1 429 Too Many Requests\r\nRetry-After: ",secs,
+			"\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+		gracefulClose("rate limited");
 	}
-	write_state = FINISHED;
+	return false;
+}
+
+void HttpConnectionBase::Scratch::Hold::on_timer(const time64_t& now) {
+	if(!connection.is_closed())
+		connection.yield(); // read() picks up the held line
+}
+
+void HttpConnectionBase::end_request() {
+	if(in_flight) {
+		in_flight = false;
+		scheduler.end_request();
+	}
+}
+
+/*** HttpResponse ***/
+
+HttpResponse::HttpResponse(HttpConnectionBase& c): connection(c), next(NULL), finished(false), in_flight(false),
+	version(c.version), keep_alive(c.keep_alive), out_encoding_chunked(c.out_encoding_chunked), write_state(c.write_state) {}
+
+HttpResponse::~HttpResponse() {
+	if(in_flight)
+		connection.scheduler.end_request();
+}
+
+HttpResponse::Writing::Writing(HttpResponse& r): response(r), prev(r.connection.current) {
+	response.swap_state();
+	response.connection.current = &response;
+}
+
+HttpResponse::Writing::~Writing() {
+	HttpConnectionBase& connection = response.connection;
+	connection.current = prev;
+	response.swap_state();
+	if((&response == connection.pending_head) && !connection.is_closed())
+		connection.yield(); // read() sends what has been written
+}
+
+void HttpResponse::swap_state() {
+	std::swap(version,connection.version);
+	std::swap(keep_alive,connection.keep_alive);
+	std::swap(out_encoding_chunked,connection.out_encoding_chunked);
+	std::swap(write_state,connection.write_state);
+}
+
+void HttpResponse::writeResponseCode(int code,const char* message) {
+	Writing writing(*this);
+	connection.writeResponseCode(code,message);
+}
+
+void HttpResponse::writeHeader(const char* header,const char* value) {
+	Writing writing(*this);
+	connection.writeHeader(header,value);
+}
+
+void HttpResponse::writeHeaders(const HttpHeaderBlock& headers) {
+	Writing writing(*this);
+	connection.writeHeaders(headers);
+}
+
+void HttpResponse::write(const void* ptr,size_t len) {
+	Writing writing(*this);
+	connection.write(ptr,len);
+}
+
+void HttpResponse::write(const char* str) {
+	write(str,strlen(str));
+}
+
+void HttpResponse::finish() {
+	if(finished)
+		ThrowInternalError("response already finished");
+	if(in_flight) {
+		in_flight = false;
+		connection.scheduler.end_request();
+	}
+	Writing writing(*this);
+	connection.finishHeader();
+	if(connection.out_encoding_chunked) // finish chunk
+		connection.emit_const("\r\n0\r\n\r\n");
+	finished = true;
+}
+
+/*** HttpHeaderBlock ***/
+
+HttpHeaderBlock& HttpHeaderBlock::add(const char* header,const char* value) {
+	buf.write(header).write(": ").write(value).write("\r\n");
+	if(!strcasecmp(header,"Content-Length"))
+		content_length = true;
+	return *this;
 }
 
 /*** HttpError ***/
@@ -224,201 +1102,215 @@ const char* const HttpError::ERequestEntityTooLarge = "413 Request Entity Too La
 const char* const HttpError::EMethodNotAllowed = "405 Method Not Allowed";
 const char* const HttpError::EPreconditionFailed = "412 Precondition Failed";
 const char* const HttpError::EBadRequest = "400 Bad Request";
+const char* const HttpError::EInternalServerError = "500 Internal Server Error";
+
+void HttpError::Write(const char* msg,HttpConnectionBase& client) {
+	client.emit_const("HTTP/1.0 ");
+	client.emit_const(msg);
+	client.emit_const("\r\nConnection: close\r\n\r\n");
+}
 
-void HttpError::Throw(const char* msg,HttpServerConnection& client) {
+void HttpError::Throw(const char* msg,HttpConnectionBase& client) {
 	client.dump_context(stderr);
-	client.async_write("HTTP/1.0 ");
-	client.async_write(msg);
-	client.async_write("\r\nConnection: close\r\n\r\n");
+	Write(msg,client);
 	ThrowGracefulClose(msg);
-};
-
-/*** HttpParams ***/
-
-static bool is_valid_url_char(char c) {
-	return ((('0'<=c)&&('9'>=c))||
-		(('a'<=c)&&('z'>=c))||
-		(('A'<=c)&&('Z'>=c))||
-		strchr("$-_.+!*'(),",c));
-}
-static bool is_special_char(char c) {
-	return (('&'==c)||('='==c));
 }
 
-static bool to_hex(char c,char& ret) {
-	if(('0'<=c)&&('9'>=c))
-		ret |= (c-'0');
-	else if(('a'<=c)&&('f'>=c))
-		ret |= ((c-'a')+10);
-	else if(('A'<=c)&&('F'>=c))
-		ret |= ((c-'A')+10);
-	else
-		return false;
-	return true;
+void HttpError::Send(const char* msg,HttpConnectionBase& client) {
+	client.dump_context(stderr);
+	fprintf(stderr,"%s\n",msg);
+	Write(msg,client);
+	client.gracefulClose(msg);
 }
 
-HttpParams::HttpParams(char* p): params(p), len(0), n(0) {
-	// first, decode any unnecessary encodings
-	char* dest = p;
-	if(params) {
-		for(const char* src = params; *src; src++) {
-			if(is_valid_url_char(*src) || is_special_char(*src)) {
-				*dest++ = *src;
-			} else if('%'==*src) {
-				char hex = 0;
-				for(int i=0; i<2; i++) {
-					hex <<= 4;
-					if(!to_hex(*++src,hex))
-						goto abort;
-				}
-				if(is_valid_url_char(hex)) {
-					*dest++ = hex;
-				} else { // revert it
-					*dest++ = '%';
-					*dest++ = src[-1];
-					*dest++ = *src;
-				}
-			} else
-				goto abort;
+/*** HttpParams ***/
+
+/* how each byte of a query string is treated */
+enum {
+	URL_INVALID,
+	URL_PLAIN,
+	URL_PERCENT,
+	URL_EQUALS,
+	URL_AMPERSAND,
+};
+
+struct UrlTables {
+	uint8_t kind[256];
+	int8_t hex[256]; // -1 if not a hex digit
+	constexpr UrlTables(): kind(), hex() {
+		for(int c=0; c<256; c++) {
+			kind[c] = URL_INVALID;
+			hex[c] = -1;
 		}
+		for(int c='0'; c<='9'; c++) {
+			kind[c] = URL_PLAIN;
+			hex[c] = c-'0';
+		}
+		for(int c='a'; c<='z'; c++)
+			kind[c] = kind[c-'a'+'A'] = URL_PLAIN;
+		for(int c=0; c<6; c++)
+			hex['a'+c] = hex['A'+c] = 10+c;
+		for(const char* c = "$-_.+!*'(),"; *c; c++)
+			kind[(uint8_t)*c] = URL_PLAIN;
+		kind['%'] = URL_PERCENT;
+		kind['='] = URL_EQUALS;
+		kind['&'] = URL_AMPERSAND;
 	}
-	if(!params) {
-		static char empty = '\0';
-abort:		params=&empty;
-		dest=p;
-	}
-	// put all the counters at the end
-	k = v = len = (dest-p);
-}
+};
+
+static constexpr UrlTables url_tables;
 
-void HttpParams::restore() {
-	if(!len)
+HttpParams::HttpParams(const char* params): buf(inline_buf), pairs(inline_pairs), sorted(NULL),
+	count(0), cur(-1), valid(true) {
+	if(!params)
 		return;
-	if(k != len) {
-		if(params[v]) {
-			params[v-1]='=';
-			reencode(params+v,n-v-1);
-			v--;
+	const size_t len = strlen(params);
+	if(len >= INLINE_BUF) {
+		buf = reinterpret_cast<char*>(malloc(len+1));
+		if(!buf)
+			ThrowInternalError("out of memory");
+	}
+	try {
+		if(!decode(params,len)) {
+			valid = false;
+			count = 0;
+		}
+		if(count > LINEAR_GET) {
+			sorted = new uint32_t[count];
+			for(size_t i=0; i<count; i++)
+				sorted[i] = i;
+			const Pair* p = pairs;
+			std::stable_sort(sorted,sorted+count,[p](uint32_t a,uint32_t b) { return strcmp(p[a].key,p[b].key) < 0; });
 		}
-		params[v+strlen(value())]='&';
-		reencode(params+k,v-k);
+	} catch(...) {
+		release();
+		throw;
 	}
-	params[len]='\0';
 }
 
-void HttpParams::reset() {
-	restore();
-	k = v = len;
-	n = 0;
+HttpParams::~HttpParams() {
+	release();
 }
 
-bool HttpParams::next() {
-	if(n>=len)
-		return false;
-	restore();
-	k=n;
-	for(int i=k; i<len; i++) {
-		if('&'==params[i]) {
-			// no value
-			params[i]='\0';
-			v=i; // to the 0
-			n=i+1;
-			goto done;
-		} else if('='==params[i]) {
-			// found it
-			params[i]='\0';
-			v=i+1;
-			// delimit it
-			for(int j=v; j<len; j++) {
-				if('&'==params[j]) {
-					params[j]='\0';
-					n=j+1;
-					goto done;
-				}
-			}
-			n=len;
-			goto done;
-		}
-	}
-	v = n = len;
-done:	if(!decode(params+k) || !decode(params+v))
-		return false;
-	return params[k]; // anonymous values illegal?
+void HttpParams::release() {
+	if(buf != inline_buf)
+		free(buf);
+	if(pairs != inline_pairs)
+		free(pairs);
+	delete[] sorted;
+	buf = inline_buf;
+	pairs = inline_pairs;
+	sorted = NULL;
+	count = 0;
 }
 
-bool HttpParams::decode(char* dest) {
-	for(char* src = dest; *src; src++) {
-		if('%'==*src) {
-			char hex = 0;
-			for(int i=0; i<2; i++) {
-				hex <<= 4;
-				if(!to_hex(*++src,hex))
-					return false;
-			}
-			*dest++ = hex;
-		} else {
-			// validate
-			if(is_valid_url_char(*src))
-				*dest++ = *src;
-			else
+bool HttpParams::decode(const char* src,size_t len) {
+	/* each = or & becomes the \0 ending the key or value before it, and a %xx is shorter than
+	   what it decodes to, so the decoded pairs never need more than len+1 bytes */
+	size_t capacity = INLINE_PAIRS;
+	const char* const end = src+len;
+	char* dest = buf;
+	const char* key = dest;
+	const char* value = NULL;
+	for(;;) {
+		const int kind = (src < end)? url_tables.kind[(uint8_t)*src]: URL_AMPERSAND;
+		switch(kind) {
+		case URL_PLAIN:
+			*dest++ = *src++;
+			continue;
+		case URL_PERCENT: {
+			const int hi = (src+1 < end)? url_tables.hex[(uint8_t)src[1]]: -1;
+			const int lo = (src+2 < end)? url_tables.hex[(uint8_t)src[2]]: -1;
+			if((0 > hi) || (0 > lo) || !(hi|lo)) // %00 would truncate it
+				return false;
+			*dest++ = (hi<<4)|lo;
+			src += 3;
+			} continue;
+		case URL_EQUALS:
+			if(value) // the value can't have an unencoded =
 				return false;
+			*dest++ = '\0';
+			value = dest;
+			src++;
+			continue;
+		case URL_AMPERSAND:
+			*dest++ = '\0';
+			if(*key) { // empty keys are skipped
+				if(count == capacity) {
+					capacity *= 2;
+					Pair* grown = reinterpret_cast<Pair*>(malloc(capacity*sizeof(Pair)));
+					if(!grown)
+						ThrowInternalError("out of memory");
+					memcpy(grown,pairs,count*sizeof(Pair));
+					if(pairs != inline_pairs)
+						free(pairs);
+					pairs = grown;
+				}
+				pairs[count].key = key;
+				pairs[count].value = value? value: "";
+				count++;
+			}
+			if(src++ >= end)
+				return true;
+			key = dest;
+			value = NULL;
+			continue;
+		default:
+			return false;
 		}
 	}
-	*dest = 0;
-	return true;
 }
 
-void HttpParams::reencode(char* p,int len) {
-	const int slen = strnlen(p,this->len-(params-p));
-	if(slen>=len) // nothing to do?
-		return;
-	char* dest = (p + len - 1); // the last char of the decoded version
-	const char* src = (p + slen - 1); // the last char of the encoded version
-	for(; src>=p; src--) {
-		assert(dest >= p);
-		if(is_valid_url_char(*src))
-			*dest-- = *src;
-		else {
-			char byte = *src;
-			for(int i=0; i<2; i++) {
-				char hex;
-				if(10>(byte&0x0f))
-					hex = '0'+(byte&0x0f);
-				else
-					hex = 'A'+(byte&0x0f);
-				*dest-- = hex;
-				byte >>= 4;
-			}
-			*dest-- = '%';
-		}
+const char* HttpParams::get(const char* k,const char* def) const {
+	if(!sorted) {
+		for(size_t i=0; i<count; i++)
+			if(!strcmp(pairs[i].key,k))
+				return pairs[i].value;
+		return def;
+	}
+	size_t lo = 0, hi = count; // the first with a key not less than k
+	while(lo < hi) {
+		const size_t mid = (lo+hi)/2;
+		if(strcmp(pairs[sorted[mid]].key,k) < 0)
+			lo = mid+1;
+		else
+			hi = mid;
 	}
-	assert(src==dest);
+	if((lo < count) && !strcmp(pairs[sorted[lo]].key,k))
+		return pairs[sorted[lo]].value;
+	return def;
 }
 
-const char* HttpParams::key() const { return (params+k); }
+const char* HttpParams::key() const { return ((0 <= cur) && ((size_t)cur < count))? pairs[cur].key: ""; }
 
-const char* HttpParams::value() const { return (params+v); }
+const char* HttpParams::value() const { return ((0 <= cur) && ((size_t)cur < count))? pairs[cur].value: ""; }
+
+void HttpParams::reset() {
+	cur = -1;
+}
+
+bool HttpParams::next() {
+	if((size_t)(cur+1) >= count)
+		return false;
+	cur++;
+	return true;
+}
 
 void HttpParams::UnitTest(const char* p) {
 	printf("params=\"%s\"\n",p);
-	char buf[1024] = {0};
-	if(p)
-		strncpy(buf,p,sizeof(buf));
-	HttpParams params(p? buf: NULL);
+	HttpParams params(p);
+	printf("\t%s, %zu pairs\n",params.is_valid()? "valid": "INVALID",params.size());
 	int count=0;
 	while(params.next() && count<10) {
 		count++;
-		printf("\t%d: key=\"%s\", value=\"%s\"\n",count,params.key(),params.value());
-		printf("\t\tparams=\"%s\"\n",buf);
+		printf("\t%d: key=\"%s\", value=\"%s\", get=\"%s\"\n",count,params.key(),params.value(),params.get(params.key()));
 	}
 	params.reset();
-	printf("\tbefore: \"%s\"\n\tafter:  \"%s\"\n",p,buf);
 	count=0;
-	while(params.next() && count<10) {
+	while(params.next())
 		count++;
-		printf("\t%d: key=\"%s\", value=\"%s\"\n",count,params.key(),params.value());
-		printf("\t\tparams=\"%s\"\n",buf);
-	}
+	if(count != (int)params.size())
+		printf("\tRESET FAILED: %d after reset\n",count);
 }
 
 void upper(char* s) { // in-place
@@ -5,59 +5,373 @@
 #define HTTP_HPP
 
 #include "task.hpp"
+#include "iobuf.hpp"
+
+#include <type_traits>
 
 class HttpError;
+class HttpHeaderBlock;
+class HttpResponse;
+class WorkerPool;
 
 void upper(char* s); // in-place
 void lower(char* s); // in-place
 
-class HttpServerConnection: private Task {
+typedef InLine<1024*5> HttpLine;
+
+/* the standard headers, which are recognised by a perfect hash when they are read, so they can be
+   fetched by id with get_header() rather than compared by name */
+#define HTTP_HEADERS(X) \
+	X(ACCEPT,"accept") \
+	X(ACCEPT_CHARSET,"accept-charset") \
+	X(ACCEPT_ENCODING,"accept-encoding") \
+	X(ACCEPT_LANGUAGE,"accept-language") \
+	X(ACCEPT_RANGES,"accept-ranges") \
+	X(ACCESS_CONTROL_REQUEST_HEADERS,"access-control-request-headers") \
+	X(ACCESS_CONTROL_REQUEST_METHOD,"access-control-request-method") \
+	X(AGE,"age") \
+	X(ALLOW,"allow") \
+	X(AUTHORIZATION,"authorization") \
+	X(CACHE_CONTROL,"cache-control") \
+	X(CONNECTION,"connection") \
+	X(CONTENT_DISPOSITION,"content-disposition") \
+	X(CONTENT_ENCODING,"content-encoding") \
+	X(CONTENT_LANGUAGE,"content-language") \
+	X(CONTENT_LENGTH,"content-length") \
+	X(CONTENT_LOCATION,"content-location") \
+	X(CONTENT_MD5,"content-md5") \
+	X(CONTENT_RANGE,"content-range") \
+	X(CONTENT_TYPE,"content-type") \
+	X(COOKIE,"cookie") \
+	X(DATE,"date") \
+	X(DNT,"dnt") \
+	X(ETAG,"etag") \
+	X(EXPECT,"expect") \
+	X(EXPIRES,"expires") \
+	X(FORWARDED,"forwarded") \
+	X(FROM,"from") \
+	X(HOST,"host") \
+	X(IF_MATCH,"if-match") \
+	X(IF_MODIFIED_SINCE,"if-modified-since") \
+	X(IF_NONE_MATCH,"if-none-match") \
+	X(IF_RANGE,"if-range") \
+	X(IF_UNMODIFIED_SINCE,"if-unmodified-since") \
+	X(KEEP_ALIVE,"keep-alive") \
+	X(LAST_MODIFIED,"last-modified") \
+	X(LINK,"link") \
+	X(LOCATION,"location") \
+	X(MAX_FORWARDS,"max-forwards") \
+	X(ORIGIN,"origin") \
+	X(PRAGMA,"pragma") \
+	X(PROXY_AUTHORIZATION,"proxy-authorization") \
+	X(PROXY_CONNECTION,"proxy-connection") \
+	X(RANGE,"range") \
+	X(REFERER,"referer") \
+	X(RETRY_AFTER,"retry-after") \
+	X(SEC_FETCH_DEST,"sec-fetch-dest") \
+	X(SEC_FETCH_MODE,"sec-fetch-mode") \
+	X(SEC_FETCH_SITE,"sec-fetch-site") \
+	X(SEC_FETCH_USER,"sec-fetch-user") \
+	X(SEC_WEBSOCKET_KEY,"sec-websocket-key") \
+	X(SEC_WEBSOCKET_PROTOCOL,"sec-websocket-protocol") \
+	X(SEC_WEBSOCKET_VERSION,"sec-websocket-version") \
+	X(SERVER,"server") \
+	X(TE,"te") \
+	X(TRAILER,"trailer") \
+	X(TRANSFER_ENCODING,"transfer-encoding") \
+	X(UPGRADE,"upgrade") \
+	X(UPGRADE_INSECURE_REQUESTS,"upgrade-insecure-requests") \
+	X(USER_AGENT,"user-agent") \
+	X(VIA,"via") \
+	X(WARNING,"warning") \
+	X(X_FORWARDED_FOR,"x-forwarded-for") \
+	X(X_FORWARDED_HOST,"x-forwarded-host") \
+	X(X_FORWARDED_PROTO,"x-forwarded-proto") \
+	X(X_REAL_IP,"x-real-ip") \
+	X(X_REQUESTED_WITH,"x-requested-with")
+
+enum HttpHeaderId {
+#define HTTP_HEADER_ID(id,name) HDR_##id,
+	HTTP_HEADERS(HTTP_HEADER_ID)
+#undef HTTP_HEADER_ID
+	HDR_COUNT,
+	HDR_UNKNOWN = HDR_COUNT,
+};
+
+HttpHeaderId http_header_id(const char* name,size_t len); // case-insensitive; HDR_UNKNOWN if it isn't standard
+const char* http_header_name(HttpHeaderId id); // lower-case
+
+struct HttpBody {
+	/* a request body collected for a handler's on_body_complete(): in buf if it is small, else in
+	   an unlinked temporary file, written with splice so its offset is still 0.  The file is
+	   closed once on_body_complete() returns, unless the handler takes fd, leaving -1 */
+	HttpBody(): length(0), fd(-1) {}
+	bool in_file() const { return -1 != fd; }
+	uint64_t length;
+	IOBuf buf;
+	FD fd;
+};
+
+class HttpConnectionBase: private Task {
+	/* everything about a server connection except the dispatch of the callbacks, which is
+	   compiled into each BasicHttpServerConnection<Handler> */
 public:
 	void dump_context(FILE* out) const;
 	using Task::construct;
 	using Task::close;
+	using Task::is_closed;
+	/* deadlines that a slow client can't push back by trickling bytes: a request has
+	   header_millisecs from its first byte to the end of its headers, then its body must come at
+	   body_min_rate bytes a second on average after body_grace_millisecs, and a connection can
+	   wait idle_millisecs for its next request (or its first).  Whilst waiting it is idle, so it
+	   can be reaped (see Scheduler::set_idle_reaping()).  They apply from each connection's next
+	   change of phase; 0 disables one, and all are 0 until set */
+	struct Deadlines {
+		uint32_t header_millisecs;
+		uint32_t body_grace_millisecs;
+		uint32_t body_min_rate;
+		uint32_t idle_millisecs;
+	};
+	static void set_deadlines(const Deadlines& deadlines);
+	static const Deadlines& get_deadlines() { return deadlines; }
+	/* how bodies are collected for a handler with on_body_complete(): one whose Content-Length is
+	   over threshold is spliced socket->pipe->file into dir, so it never passes through user space
+	   and memory stays flat however big it is, and the rest are gathered in memory.  A request
+	   without a length has no body.  The pipe->file half is done on pool, with the connection not
+	   reading whilst the disk is behind; without a pool nothing is spooled, as a slow disk would
+	   stall the loop, and bodies over threshold are turned away */
+	struct Spooling {
+		uint64_t threshold;
+		const char* dir;
+		WorkerPool* pool;
+	};
+	static void set_spooling(const Spooling& spooling);
+	static const Spooling& get_spooling() { return spooling; }
 protected:
 	friend class HttpError;
-	HttpServerConnection(Scheduler& scheduler,FD accept_fd);
+	HttpConnectionBase(Scheduler& scheduler,FD accept_fd);
+	~HttpConnectionBase();
 	void do_construct();
 	void gracefulClose(const char* reason=NULL);
-	// callbacks when a request comes in
-	virtual void on_request(const char* method,const char* uri) {}
-	virtual void on_header(const char* header,const char* value) {}
-	virtual void on_body() {}
-	virtual void on_data(const void* chunk,size_t len) {}
+	using Task::offload;
+	using Task::scheduler; // e.g. for a timer to finish a deferred response from
 	// to respond
 	void writeResponseCode(int code,const char* message);
-	void writeHeader(const char* header,const char* value);
+	void writeHeader(const char* header,const char* value); // a Content-Length stops the body being chunked
+	void writeHeaders(const HttpHeaderBlock& headers);
 	void write(const void* ptr,size_t len);
 	void write(const char* str);
 	void writef(const char* fmt,...);
+	template<typename... Args> void writeFormat(const Args&... args); // typed; see format.hpp
 	void finish();
+	/* for a handler that can't respond until another callback e.g. a Job's done(): from on_body()
+	   or on_data(), hands over the response to finish later, and the connection carries on parsing
+	   the requests pipelined after it.  Their responses are held back until those before them have
+	   gone, however they finish; once MAX_PENDING are waiting, parsing stops until some go.  What
+	   the handler needs of the request must be copied now, as the next request reuses uri and the
+	   headers */
+	HttpResponse* defer();
+	enum { MAX_PENDING = 16 };
+	// the request's headers, valid until the response is finished
+	const char* get_header(HttpHeaderId id) const; // the first one, or NULL if there wasn't one
+	const char* get_header(const char* name) const; // any header, by case-insensitive name
+	size_t get_other_header_count() const; // unknown headers, and repeats of known ones
+	void get_other_header(size_t i,const char*& name,const char*& value) const;
 protected:
-	enum {
+	enum Version {
 		HTTP_0_9,
 		HTTP_1_0,
 		HTTP_1_1,
 	} version;
-	char uri[1024];
-	InLine<1024*5> line;
+	const char* uri; // valid until the response is finished
 	bool keep_alive;
-private:
-	void read();
-	void disconnected();
-	inline void finishHeader();
-private:
-	enum {
+protected: // for the parser in BasicHttpServerConnection
+	using Task::next_request;
+	using Task::defer_input;
+	const char* read_request_line(); // NULL if there isn't one yet
+	bool read_header(HttpHeaderId& id,const char*& header,const char*& value); // header is NULL at the end of the headers
+	const char* raw_header_name() const; // the header just read, as it came in and with its colon; valid until the next line is read
+	bool read_body(uint8_t*& chunk,uint16_t& len); // false when there isn't a chunk
+	HttpBody* collect_body(); // NULL until it is all in
+	void release_body();
+	void next_line();
+	enum State {
 		LINE,
 		HEADER,
 		BODY,
 		FINISHED,
 	} read_state, write_state;
+	bool has_pending() const { return pending_head; }
+	void send_pending(); // what has been written of the responses at the front of the queue, in order
+private:
+	friend class HttpResponse;
+	void disconnected();
+	inline void finishHeader();
+	/* what is written of a response goes straight out, unless there are deferred responses ahead of
+	   it, when it goes into the current HttpResponse's buffer */
+	void emit(const void* ptr,size_t len); // copied
+	void emit_const(const void* ptr,size_t len); // ptr must outlive the connection
+	void emit_const(const char* str);
+	template<typename... Args> void emit_format(const Args&... args);
+	HttpResponse& buffered(); // the current response, which is queued if it isn't already
+	void drained();
+	class Spool;
+	bool spool_body(); // false until it is all in
+	void spooled(); // back from the pool
+	void end_body();
+	void shed(); // the scheduler won't admit the request; turn it away without a handler seeing it
+	bool take_rate_token(); // false if the request line has been held or turned away
+	void end_request();
+	// moving between the phases the deadlines apply to
+	void await_request();
+	void start_request(); // the first bytes of its request line are in
+	void start_body();
+	void body_progress(size_t len);
+	void busy(); // no deadline whilst the handler has the request
+	/* the parsing buffers are only needed while a request is in progress, so idle keep-alive
+	   connections give them back to the scheduler's pool */
+	struct Headers {
+		/* the values, and the names of the headers that aren't known, are copied into store as
+		   they are read, as the line they came in is reused */
+		enum { STORE = 4096, MAX_OTHER = 64 };
+		void clear();
+		const char* add(const char* str,size_t len); // NULL if there isn't room
+		uint16_t known[HDR_COUNT]; // offsets+1 of the values in store, or 0
+		struct Other {
+			uint16_t name, value; // offsets in store
+		} other[MAX_OTHER];
+		uint16_t other_count, used;
+		char store[STORE];
+	};
+	struct Scratch {
+		Scratch(HttpConnectionBase& connection): hold(connection), held(false), spool(NULL) {}
+		HttpLine line;
+		char uri[1024];
+		Headers headers;
+		struct Hold: public Timer {
+			Hold(HttpConnectionBase& c): connection(c) {}
+			void on_timer(const time64_t& now);
+			HttpConnectionBase& connection;
+		} hold;
+		bool held; // the line is a request line waiting on hold for its rate-limit token
+		time64_t body_start;
+		uint64_t body_read;
+		HttpBody body; // for on_body_complete()
+		Spool* spool; // if the body is going to a file
+	};
+	Scratch& get_scratch();
+	void release_scratch();
+	template<typename... Pieces> void writePieces(const Pieces&... pieces);
+private:
+	Scratch* scratch;
 	bool in_encoding_chunked, out_encoding_chunked;
-	int in_content_length; //-1 means not known
+	bool in_flight; // admitted by the scheduler, and not yet finished or deferred
+	HttpResponse* pending_head; // responses waiting to go, in order
+	HttpResponse* pending_tail;
+	HttpResponse* current; // the one being written, if it is buffered
+	unsigned pending;
+	enum {
+		PHASE_IDLE,
+		PHASE_HEADERS,
+		PHASE_BODY,
+		PHASE_BUSY,
+	} phase; // which deadline applies
+	static Deadlines deadlines;
+	static Spooling spooling;
+	int64_t in_content_length; //-1 means not known
 	int count;
 };
 
+template<class Handler> class BasicHttpServerConnection: public HttpConnectionBase {
+	/* the Handler is the most-derived class, and its on_request(), on_header(), on_body() and
+	   on_data() hide these defaults; the calls are resolved at compile time, so they inline into
+	   the parser, and on_header() isn't called at all for a Handler that doesn't have one.  A
+	   Handler with on_body_complete() gets the whole body there instead of in on_data() chunks;
+	   see Spooling.  The Handler's callbacks must be accessible to this class e.g. by befriending it */
+protected:
+	BasicHttpServerConnection(Scheduler& scheduler,FD accept_fd): HttpConnectionBase(scheduler,accept_fd) {}
+	// callbacks when a request comes in
+	void on_request(const char* method,const char* uri) {}
+	void on_header(HttpHeaderId id,const char* header,const char* value) {} // header has no trailing colon, and is lower-case if it is known
+	void on_body() {}
+	void on_data(const void* chunk,size_t len) {}
+	void on_body_complete(HttpBody& body) {}
+private:
+	void read();
+	Handler& handler() { return static_cast<Handler&>(*this); }
+	// which class the Handler's on_header() is from; picks it out of overloads of other signatures
+	template<class C> static C* declared_by(void (C::*)(HttpHeaderId,const char*,const char*));
+	typedef void (BasicHttpServerConnection::*DefaultOnBodyComplete)(HttpBody&);
+};
+
+class HttpServerConnection: public BasicHttpServerConnection<HttpServerConnection> {
+	/* for convenience, the callbacks as virtual functions */
+protected:
+	HttpServerConnection(Scheduler& scheduler,FD accept_fd): BasicHttpServerConnection<HttpServerConnection>(scheduler,accept_fd) {}
+	friend class BasicHttpServerConnection<HttpServerConnection>;
+	// callbacks when a request comes in
+	virtual void on_request(const char* method,const char* uri) {}
+	virtual void on_header(HttpHeaderId id,const char* header,const char* value) { on_header(raw_header_name(),value); }
+	virtual void on_header(const char* header,const char* value) {} // the original callback; header is as it came in, with its trailing colon
+	virtual void on_body() {}
+	virtual void on_data(const void* chunk,size_t len) {}
+};
+
+class HttpResponse {
+	/* a response that its handler finishes after its callbacks have returned; see
+	   HttpConnectionBase::defer().  It belongs to the connection, so it is gone once finished or
+	   once the connection closes.  What is written is buffered until the responses ahead of it have
+	   gone, and then the connection sends it; in the meantime the handler can write it in pieces */
+public:
+	void writeResponseCode(int code,const char* message);
+	void writeHeader(const char* header,const char* value);
+	void writeHeaders(const HttpHeaderBlock& headers);
+	void write(const void* ptr,size_t len);
+	void write(const char* str);
+	template<typename... Args> void writeFormat(const Args&... args);
+	void finish();
+private:
+	friend class HttpConnectionBase;
+	explicit HttpResponse(HttpConnectionBase& connection);
+	~HttpResponse();
+	HttpResponse(const HttpResponse&);
+	void operator=(const HttpResponse&);
+	void swap_state();
+	class Writing {
+		// the connection's writers are used, with this response's state swapped in
+	public:
+		explicit Writing(HttpResponse& response);
+		~Writing();
+	private:
+		HttpResponse& response;
+		HttpResponse* prev;
+	};
+	HttpConnectionBase& connection;
+	HttpResponse* next; // behind this in the connection's queue
+	IOBuf buf; // written, and not yet handed to the connection
+	bool finished;
+	bool in_flight; // the request's admission, until finished
+	// the connection's response state, swapped in whilst writing
+	HttpConnectionBase::Version version;
+	bool keep_alive, out_encoding_chunked;
+	HttpConnectionBase::State write_state;
+};
+
+class HttpHeaderBlock {
+	/* headers that are the same on every response - Server, Content-Type, cache policy - serialized
+	   once at startup, so writing them is a memcpy into the write buffer, or an OutConst if it is
+	   full.  Don't add to a block that responses are already using */
+public:
+	HttpHeaderBlock(): content_length(false), buf(256) {}
+	HttpHeaderBlock& add(const char* header,const char* value);
+	const char* data() const { return reinterpret_cast<const char*>(buf.data()); }
+	size_t length() const { return buf.length(); }
+	bool has_content_length() const { return content_length; }
+private:
+	bool content_length;
+	Buffer buf;
+};
+
 class HttpError: private HalfClose {
 public:
 	static const char* const ENotFound;
@@ -66,26 +380,127 @@ public:
 	static const char* const EMethodNotAllowed;
 	static const char* const EPreconditionFailed;
 	static const char* const EBadRequest;
-	static void Throw(const char* msg,HttpServerConnection& client);
+	static const char* const EInternalServerError;
+	static void Throw(const char* msg,HttpConnectionBase& client);
+	static void Send(const char* msg,HttpConnectionBase& client); // like Throw, but without unwinding the caller
+private:
+	static void Write(const char* msg,HttpConnectionBase& client);
 };
 
 class HttpParams {
+	/* a query string, validated and percent-decoded in one table-driven pass into a buffer of its
+	   own, with an index of the key/value pairs sorted by key for get(); the query string itself
+	   isn't touched.  Empty pairs are skipped, and an invalid query string has no pairs */
 public:
-	HttpParams(char* params);
+	HttpParams(const char* params);
+	~HttpParams();
+	bool is_valid() const { return valid; }
+	size_t size() const { return count; }
+	const char* key(size_t i) const { return pairs[i].key; }
+	const char* value(size_t i) const { return pairs[i].value; }
+	const char* get(const char* key,const char* def = NULL) const; // the first value for key
+	// in query string order
 	const char* key() const;
 	const char* value() const;
 	void reset();
 	bool next();
 	static void UnitTest(const char* params);
 private:
-	bool decode(char* p);
-	void reencode(char* p,int len);
-	void restore();
-private:
-	char* params;
-	int len;
-	int k, v, n;
+	HttpParams(const HttpParams&);
+	void operator=(const HttpParams&);
+	bool decode(const char* params,size_t len);
+	void release();
+	struct Pair {
+		const char* key;
+		const char* value;
+	};
+	enum { INLINE_BUF = 256, INLINE_PAIRS = 16, LINEAR_GET = 8 };
+	char* buf;
+	Pair* pairs;
+	uint32_t* sorted; // indices into pairs, by key, if there are more than LINEAR_GET; a query string would need 8GB to have more
+	size_t count;
+	int cur; // for next()
+	bool valid;
+	char inline_buf[INLINE_BUF];
+	Pair inline_pairs[INLINE_PAIRS];
 };
 
+template<typename... Args> void HttpConnectionBase::writeFormat(const Args&... args) {
+	writePieces(fmt::piece(args)...);
+}
+
+template<typename... Pieces> void HttpConnectionBase::writePieces(const Pieces&... pieces) {
+	// rendered first, as a chunk needs its length up front
+	const size_t max = fmt::max_length(pieces...);
+	if(max <= 1024) {
+		char buf[1024];
+		write(buf,fmt::render_all(buf,pieces...) - buf);
+		return;
+	}
+	Cleanup<char,CleanupFree> buf(reinterpret_cast<char*>(malloc(max)));
+	if(!buf)
+		ThrowInternalError("out of memory");
+	write(buf.ptr(),fmt::render_all(buf.ptr(),pieces...) - buf.ptr());
+}
+
+template<typename... Args> void HttpResponse::writeFormat(const Args&... args) {
+	Writing writing(*this);
+	connection.writeFormat(args...);
+}
+
+template<class Handler> void BasicHttpServerConnection<Handler>::read() {
+	const bool wants_headers = !std::is_same<decltype(declared_by(&Handler::on_header)),BasicHttpServerConnection*>::value;
+	const bool wants_body = !std::is_same<decltype(&Handler::on_body_complete),DefaultOnBodyComplete>::value;
+	if(has_pending())
+		send_pending();
+	while(!is_closed()) {
+		switch(read_state) {
+		case LINE:
+			if(!next_request())
+				return;
+			if(const char* method = read_request_line()) {
+				handler().on_request(method,uri);
+				next_line();
+				break;
+			}
+			return;
+		case HEADER: {
+			HttpHeaderId id;
+			const char *header, *value;
+			if(!read_header(id,header,value))
+				return;
+			if(header) {
+				if(wants_headers)
+					handler().on_header(id,header,value);
+				next_line();
+			} else
+				handler().on_body();
+			} break;
+		case BODY: {
+			if(wants_body) {
+				if(HttpBody* body = collect_body()) {
+					handler().on_body_complete(*body);
+					release_body();
+				}
+				if(LINE != read_state)
+					return;
+				break;
+			}
+			uint8_t* chunk;
+			uint16_t len;
+			while(read_body(chunk,len))
+				handler().on_data(chunk,len);
+			if(LINE != read_state)
+				return;
+			} break;
+		case FINISHED: // a response that closes the connection is waiting behind deferred ones
+			defer_input();
+			return;
+		default:
+			ThrowInternalError("unexpected read_state");
+		}
+	}
+}
+
 #endif //HTTP_HPP
 
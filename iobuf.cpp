@@ -0,0 +1,308 @@
+/* (c) William Edwards, 2011
+   Using the Simplified BSD License.  See LICENSE file for details */
+
+#include "iobuf.hpp"
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <algorithm>
+
+IOBuf::IOBuf(): len(0) {}
+
+IOBuf::IOBuf(const IOBuf& copy): slices(copy.slices), len(copy.len) {
+	for(size_t i=0; i<slices.size(); i++)
+		ref(slices[i]);
+}
+
+IOBuf& IOBuf::operator=(const IOBuf& copy) {
+	if(this != &copy) {
+		for(size_t i=0; i<copy.slices.size(); i++)
+			ref(copy.slices[i]); // before unreffing ours, in case they share
+		clear();
+		slices = copy.slices;
+		len = copy.len;
+	}
+	return *this;
+}
+
+IOBuf::~IOBuf() {
+	clear();
+}
+
+IOBuf::Segment* IOBuf::alloc_segment(size_t capacity) {
+	capacity = std::max<size_t>(capacity,SEGMENT-sizeof(Segment));
+	Segment* seg = reinterpret_cast<Segment*>(malloc(sizeof(Segment)+capacity));
+	if(!seg)
+		ThrowInternalError("out of memory");
+	seg->refs = 1;
+	seg->capacity = capacity;
+	seg->used = 0;
+	return seg;
+}
+
+void IOBuf::unref(const Slice& slice) {
+	if(slice.seg && !--slice.seg->refs)
+		free(slice.seg);
+}
+
+uint8_t* IOBuf::reserve(size_t bytes) {
+	if(!slices.empty()) {
+		// the last slice can grow if nothing else has been put after it in its segment
+		Slice& last = slices.back();
+		if(last.seg && (last.ptr+last.len == last.seg->data()+last.seg->used) &&
+			(bytes <= (last.seg->capacity-last.seg->used)))
+			return last.seg->data()+last.seg->used;
+	}
+	Segment* seg = alloc_segment(bytes);
+	const Slice slice = {seg,seg->data(),0};
+	try {
+		slices.push_back(slice);
+	} catch(...) {
+		free(seg);
+		throw;
+	}
+	return seg->data();
+}
+
+IOBuf& IOBuf::append(const void* ptr,size_t bytes) {
+	const uint8_t* p = reinterpret_cast<const uint8_t*>(ptr);
+	while(bytes) {
+		// fill what is spare in the last segment before starting another
+		size_t chunk = bytes;
+		if(!slices.empty() && slices.back().seg) {
+			const Slice& last = slices.back();
+			const size_t spare = last.seg->capacity-last.seg->used;
+			if(spare && (last.ptr+last.len == last.seg->data()+last.seg->used))
+				chunk = std::min(bytes,spare);
+		}
+		memcpy(reserve(chunk),p,chunk);
+		Slice& last = slices.back();
+		last.seg->used += chunk;
+		last.len += chunk;
+		len += chunk;
+		p += chunk;
+		bytes -= chunk;
+	}
+	return *this;
+}
+
+IOBuf& IOBuf::append(const char* str) {
+	return append(str,strlen(str));
+}
+
+IOBuf& IOBuf::append(const IOBuf& other) {
+	if(this == &other) {
+		const IOBuf copy(other);
+		return append(copy);
+	}
+	slices.reserve(slices.size()+other.slices.size());
+	for(size_t i=0; i<other.slices.size(); i++) {
+		ref(other.slices[i]);
+		slices.push_back(other.slices[i]);
+	}
+	len += other.len;
+	return *this;
+}
+
+IOBuf& IOBuf::append_const(const void* ptr,size_t bytes) {
+	if(bytes) {
+		const Slice slice = {NULL,reinterpret_cast<const uint8_t*>(ptr),bytes};
+		slices.push_back(slice);
+		len += bytes;
+	}
+	return *this;
+}
+
+IOBuf& IOBuf::nprintf(size_t maxlen,const char* fmt,...) {
+	char* dest = reinterpret_cast<char*>(reserve(maxlen));
+	va_list args;
+	va_start(args,fmt);
+	const int used = vsnprintf(dest,maxlen,fmt,args);
+	va_end(args);
+	check(used);
+	if(used >= (int)maxlen)
+		ThrowInternalError("buffer overflow");
+	commit(used);
+	return *this;
+}
+
+void IOBuf::commit(size_t bytes) {
+	Slice& last = slices.back();
+	last.seg->used += bytes;
+	last.len += bytes;
+	len += bytes;
+}
+
+IOBuf& IOBuf::prepend(const void* ptr,size_t bytes) {
+	if(bytes) {
+		Segment* seg = alloc_segment(bytes);
+		memcpy(seg->data(),ptr,bytes);
+		seg->used = bytes;
+		const Slice slice = {seg,seg->data(),bytes};
+		try {
+			slices.insert(slices.begin(),slice);
+		} catch(...) {
+			free(seg);
+			throw;
+		}
+		len += bytes;
+	}
+	return *this;
+}
+
+IOBuf& IOBuf::prepend(const IOBuf& other) {
+	IOBuf joined(other);
+	joined.append(*this);
+	std::swap(slices,joined.slices);
+	std::swap(len,joined.len);
+	return *this;
+}
+
+size_t IOBuf::locate(size_t& ofs) const {
+	assert(ofs <= len);
+	size_t i = 0;
+	while((i < slices.size()) && (ofs >= slices[i].len))
+		ofs -= slices[i++].len;
+	return i;
+}
+
+IOBuf IOBuf::slice(size_t ofs,size_t bytes) const {
+	if(ofs+bytes > len)
+		ThrowInternalError("slice %zu+%zu of a %zu byte IOBuf",ofs,bytes,len);
+	IOBuf ret;
+	for(size_t i=locate(ofs); bytes; i++, ofs=0) {
+		Slice s = slices[i];
+		s.ptr += ofs;
+		s.len = std::min(s.len-ofs,bytes);
+		ref(s);
+		ret.slices.push_back(s);
+		ret.len += s.len;
+		bytes -= s.len;
+	}
+	return ret;
+}
+
+IOBuf IOBuf::split(size_t bytes) {
+	IOBuf ret = slice(0,bytes);
+	trim_front(bytes);
+	return ret;
+}
+
+void IOBuf::trim_front(size_t bytes) {
+	if(bytes > len)
+		ThrowInternalError("trimming %zu bytes from a %zu byte IOBuf",bytes,len);
+	size_t whole = 0;
+	while((whole < slices.size()) && (bytes >= slices[whole].len)) {
+		bytes -= slices[whole].len;
+		len -= slices[whole].len;
+		unref(slices[whole++]);
+	}
+	slices.erase(slices.begin(),slices.begin()+whole);
+	if(bytes) {
+		slices.front().ptr += bytes;
+		slices.front().len -= bytes;
+		len -= bytes;
+	}
+}
+
+void IOBuf::clear() {
+	for(size_t i=0; i<slices.size(); i++)
+		unref(slices[i]);
+	slices.clear();
+	len = 0;
+}
+
+char IOBuf::at(size_t ofs) const {
+	assert(ofs < len);
+	const size_t i = locate(ofs);
+	return slices[i].ptr[ofs];
+}
+
+ssize_t IOBuf::find(const void* needle,size_t needle_len,size_t start) const {
+	const uint8_t* n = reinterpret_cast<const uint8_t*>(needle);
+	if(start+needle_len > len)
+		return -1;
+	if(!needle_len)
+		return start;
+	size_t ofs = start;
+	size_t i = locate(ofs);
+	for(size_t base = start-ofs; i<slices.size(); base += slices[i++].len, ofs = 0) {
+		const Slice& s = slices[i];
+		while(ofs < s.len) {
+			const uint8_t* p = reinterpret_cast<const uint8_t*>(memchr(s.ptr+ofs,*n,s.len-ofs));
+			if(!p)
+				break;
+			ofs = p-s.ptr;
+			if(base+ofs+needle_len > len)
+				return -1;
+			// the rest of the needle may run on into the following slices
+			size_t matched = 0;
+			for(size_t j=i, o=ofs; matched<needle_len; j++, o=0) {
+				const size_t m = std::min(needle_len-matched,slices[j].len-o);
+				if(memcmp(slices[j].ptr+o,n+matched,m))
+					break;
+				matched += m;
+			}
+			if(matched == needle_len)
+				return base+ofs;
+			ofs++;
+		}
+	}
+	return -1;
+}
+
+void IOBuf::copy_out(void* dest,size_t ofs,size_t bytes) const {
+	if(ofs+bytes > len)
+		ThrowInternalError("copying %zu+%zu of a %zu byte IOBuf",ofs,bytes,len);
+	uint8_t* d = reinterpret_cast<uint8_t*>(dest);
+	for(size_t i=locate(ofs); bytes; i++, ofs=0) {
+		const size_t m = std::min(slices[i].len-ofs,bytes);
+		memcpy(d,slices[i].ptr+ofs,m);
+		d += m;
+		bytes -= m;
+	}
+}
+
+const char* IOBuf::range(size_t ofs,size_t bytes) {
+	if(ofs+bytes > len)
+		ThrowInternalError("range %zu+%zu of a %zu byte IOBuf",ofs,bytes,len);
+	if(!bytes)
+		return "";
+	size_t o = ofs;
+	const size_t first = locate(o);
+	if(bytes <= slices[first].len-o)
+		return reinterpret_cast<const char*>(slices[first].ptr+o);
+	// coalesce the slices it spans
+	size_t last = first, spanned = slices[first].len;
+	while(spanned < o+bytes)
+		spanned += slices[++last].len;
+	Segment* seg = alloc_segment(spanned);
+	copy_out(seg->data(),ofs-o,spanned);
+	seg->used = spanned;
+	for(size_t i=first; i<=last; i++)
+		unref(slices[i]);
+	slices.erase(slices.begin()+first+1,slices.begin()+last+1);
+	const Slice joined = {seg,seg->data(),spanned};
+	slices[first] = joined;
+	return reinterpret_cast<const char*>(seg->data()+o);
+}
+
+int IOBuf::get_iov(iovec* iov,int max,size_t ofs) const {
+	int filled = 0;
+	for(size_t i=locate(ofs); (i<slices.size()) && (filled<max); i++, ofs=0) {
+		iov[filled].iov_base = const_cast<uint8_t*>(slices[i].ptr+ofs);
+		iov[filled].iov_len = slices[i].len-ofs;
+		filled++;
+	}
+	return filled;
+}
+
+OutIOBuf::OutIOBuf(const IOBuf& b): Out(NULL,b.length()), buf(b) {}
+
+void OutIOBuf::release() {
+	delete this;
+}
+
+int OutIOBuf::get_iov(iovec* iov,int max) const {
+	return buf.get_iov(iov,max,ofs);
+}
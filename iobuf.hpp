@@ -0,0 +1,88 @@
+/* (c) William Edwards, 2011
+   Using the Simplified BSD License.  See LICENSE file for details */
+
+#ifndef IOBUF_HPP
+#define IOBUF_HPP
+
+#include "out.hpp"
+#include "format.hpp"
+
+#include <vector>
+
+class IOBuf {
+	/* a chain of slices of refcounted segments.  Appends are copied into the spare room at the end
+	   of the last segment, and only start a new segment when that is full; everything else -
+	   prepending, appending other IOBufs, slicing and splitting - shares segments rather than
+	   copying them.  The refcounts aren't atomic, so an IOBuf and its slices belong to one thread */
+public:
+	enum { SEGMENT = 4096 }; // bytes allocated for a segment, header included, unless more are needed
+	IOBuf();
+	IOBuf(const IOBuf& copy); // shares copy's segments
+	IOBuf& operator=(const IOBuf& copy);
+	~IOBuf();
+	size_t length() const { return len; }
+	bool empty() const { return !len; }
+	IOBuf& append(const void* ptr,size_t len);
+	IOBuf& append(const char* str);
+	IOBuf& append(const IOBuf& other);
+	IOBuf& append_const(const void* ptr,size_t len); // not copied; ptr must outlive the IOBuf and its slices
+	IOBuf& nprintf(size_t maxlen,const char* fmt,...);
+	template<typename... Args> IOBuf& format(const Args&... args); // typed; see format.hpp
+	IOBuf& prepend(const void* ptr,size_t len); // for headers only known once the body is done
+	IOBuf& prepend(const IOBuf& other);
+	IOBuf slice(size_t ofs,size_t len) const;
+	IOBuf split(size_t len); // removes the first len bytes and returns them
+	void trim_front(size_t len);
+	void clear();
+	char at(size_t ofs) const;
+	ssize_t find(const void* needle,size_t needle_len,size_t start = 0) const; // -1 if not found
+	void copy_out(void* dest,size_t ofs,size_t len) const;
+	const char* range(size_t ofs,size_t len); // contiguous; the slices it spans are copied into one segment if need be
+	int get_iov(iovec* iov,int max,size_t ofs = 0) const; // skipping ofs bytes; returns how many were filled
+	size_t get_slice_count() const { return slices.size(); }
+private:
+	struct Segment {
+		unsigned refs;
+		size_t capacity, used;
+		uint8_t* data() { return reinterpret_cast<uint8_t*>(this+1); }
+	};
+	struct Slice {
+		Segment* seg; // NULL for append_const
+		const uint8_t* ptr;
+		size_t len;
+	};
+	static Segment* alloc_segment(size_t capacity);
+	static void ref(const Slice& slice) { if(slice.seg) slice.seg->refs++; }
+	static void unref(const Slice& slice);
+	uint8_t* reserve(size_t bytes); // room at the end of the last segment, which must then be used
+	void commit(size_t bytes); // of what was reserved
+	template<typename... Pieces> IOBuf& format_pieces(const Pieces&... pieces);
+	size_t locate(size_t& ofs) const; // the slice ofs is in, and ofs becomes the offset within it
+	std::vector<Slice> slices;
+	size_t len;
+};
+
+template<typename... Args> IOBuf& IOBuf::format(const Args&... args) {
+	return format_pieces(fmt::piece(args)...);
+}
+
+template<typename... Pieces> IOBuf& IOBuf::format_pieces(const Pieces&... pieces) {
+	char* dest = reinterpret_cast<char*>(reserve(fmt::max_length(pieces...)));
+	commit(fmt::render_all(dest,pieces...) - dest);
+	return *this;
+}
+
+typedef BasicBufferReader<IOBuf> IOBufReader;
+
+class OutIOBuf: public Out {
+	/* queues an IOBuf without flattening it; its slices are written with writev */
+public:
+	explicit OutIOBuf(const IOBuf& buf);
+	void release();
+private:
+	~OutIOBuf() {}
+	int get_iov(iovec* iov,int max) const;
+	const IOBuf buf;
+};
+
+#endif //IOBUF_HPP
@@ -2,58 +2,125 @@
    Using the Simplified BSD License.  See LICENSE file for details */
 
 #include "listener.hpp"
+#include "ratelimit.hpp"
 
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
-void Listener::create(Scheduler& scheduler,const char* name,short port,Factory factory,int backlog,bool reuse_addr) {
-	Listener* self = new Listener(scheduler,name,port,factory,backlog,reuse_addr);
+void Listener::create(Scheduler& scheduler,const char* name,const char* address,Factory factory,int backlog,bool reuse_addr,unsigned flags) {
+	SocketAddress addr;
+	if(!addr.parse(address))
+		ThrowInternalError("%s has a bad address: %s",name,address);
+	Listener* self = new Listener(scheduler,name,addr,factory,backlog,reuse_addr,flags);
 	self->construct();
 }
 
-Listener::Listener(Scheduler& scheduler,const char* n,short p,Factory f,int b,bool ra):
-	Task(scheduler), name(n), port(p), factory(f), backlog(b), reuse_addr(ra) {}
-	
+void Listener::create(Scheduler& scheduler,const char* name,short port,Factory factory,int backlog,bool reuse_addr,unsigned flags) {
+	char address[8];
+	snprintf(address,sizeof(address),"*:%hu",port);
+	create(scheduler,name,address,factory,backlog,reuse_addr,flags);
+}
+
+Listener::Listener(Scheduler& scheduler,const char* n,const SocketAddress& a,Factory f,int b,bool ra,unsigned fl):
+	Task(scheduler), backoff(*this), name(n), address(a), factory(f), backlog(b), reuse_addr(ra), flags(fl),
+	reserve_fd(-1), backoff_millisecs(0), limited(false), bound(false) {}
+
+Listener::~Listener() {
+	std::vector<Task*>& limited = scheduler.limited;
+	limited.erase(std::remove(limited.begin(),limited.end(),static_cast<Task*>(this)),limited.end());
+	if(-1 != reserve_fd)
+		::close(reserve_fd);
+	if(bound && address.get_path())
+		unlink(address.get_path());
+}
+
 void Listener::do_construct() {
-	check(fd = socket(AF_INET,SOCK_STREAM,0));
+	check(fd = socket(address.family(),SOCK_STREAM|SOCK_CLOEXEC,0));
 	if(reuse_addr) {
 		int yes = 1;
 		check(setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&yes,sizeof(yes)));
+		struct stat st;
+		if(address.get_path() && !stat(address.get_path(),&st) && S_ISSOCK(st.st_mode))
+			unlink(address.get_path()); // a previous run's; binding would fail with EADDRINUSE
+	}
+	if(address.is_ipv6_any()) {
+		int no = 0; // dual-stack, whatever net.ipv6.bindv6only says
+		check(setsockopt(fd,IPPROTO_IPV6,IPV6_V6ONLY,&no,sizeof(no)));
+	}
+	check(bind(fd,address.get(),address.length()));
+	bound = true;
+	if(address.is_ip()) { // the TCP options don't apply to unix sockets
+		if(DEFER_ACCEPT & flags) {
+			int secs = DEFER_SECS;
+			check(setsockopt(fd,IPPROTO_TCP,TCP_DEFER_ACCEPT,&secs,sizeof(secs)));
+		}
+		if(FASTOPEN & flags) {
+			int qlen = backlog;
+			if(setsockopt(fd,IPPROTO_TCP,TCP_FASTOPEN,&qlen,sizeof(qlen)))
+				fprintf(stderr,"%s can't use TCP fast open: %s\n",name,strerror(errno)); // not fatal
+		}
 	}
-	sockaddr_in addr;
-	memset(&addr,0,sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(port);
-	addr.sin_addr.s_addr = INADDR_ANY;
-	check(bind(fd,reinterpret_cast<sockaddr*>(&addr),sizeof(addr)));
 	check(listen(fd,backlog));
+	check(reserve_fd = open("/dev/null",O_RDONLY|O_CLOEXEC));
 	schedule(EPOLLIN); //level-triggered
-	printf("%s is listening on port %hu...\n",name,port);
+	printf("%s is listening on %s...\n",name,address.describe());
 }
 
 void Listener::read() {
 	// we don't want any errors causing us to stop listening!
 	try {
-		do {
+		for(int budget = ACCEPT_BUDGET; budget--; ) {
+			if(scheduler.at_connection_limit()) {
+				at_connection_limit();
+				return;
+			}
 			//### would be nice to print the IP of incoming requests that fail
-			const FD accept_fd = accept(fd,NULL,0);
+			sockaddr_storage peer;
+			socklen_t peer_len = sizeof(peer);
+			const FD accept_fd = accept4(fd,reinterpret_cast<sockaddr*>(&peer),&peer_len,SOCK_NONBLOCK|SOCK_CLOEXEC);
 			if(0>accept_fd) {
 				switch(errno) {
 				case EWOULDBLOCK:
 				case ECONNABORTED: // level-triggered
 					return;
 				case EINTR:
-					break;
+					continue;
 				case ENFILE:
 				case EMFILE:
-					//### hmm, what to do? policy please
-					ThrowInternalError("not enough FDs");
+				case ENOBUFS:
+				case ENOMEM:
+					out_of_fds();
+					return;
 				default:
 					fail("error in accept");
 				}
 			}
-			factory(scheduler,accept_fd);
-		} while(true);
+			backoff_millisecs = 0;
+			limited = false;
+			scheduler.prepared_peer.set(reinterpret_cast<const sockaddr*>(&peer));
+			if(RateLimiter* rate_limit = scheduler.get_connection_rate_limit())
+				if(scheduler.prepared_peer.is_set() && rate_limit->take(scheduler.prepared_peer,scheduler.get_now())) {
+					::close(accept_fd); // before a task is made for it; the limiter counts it
+					continue;
+				}
+			if(scheduler.get_socket_busy_poll() && !set_busy_poll(accept_fd,
+				scheduler.get_socket_busy_poll(),scheduler.get_socket_prefer_busy_poll())) {
+				fprintf(stderr,"%s can't busy poll its sockets: %s\n",name,strerror(errno));
+				scheduler.set_socket_busy_poll(0,false); // so it says so only once
+			}
+			scheduler.prepared_fd = accept_fd; // so construct() doesn't fcntl it again
+			try {
+				factory(scheduler,accept_fd);
+			} catch(...) {
+				scheduler.prepared_fd = -1;
+				throw;
+			}
+			scheduler.prepared_fd = -1;
+		}
+		// the rest wait for the next wakeup, which level-triggering guarantees
 	} catch(Error* e) {
 		e->dump(this);
 		e->release();
@@ -64,7 +131,45 @@ void Listener::read() {
 	}
 }
 
-void Listener::dump_context(FILE* out) const {
-	fprintf(out,"Listener[%s@%hu] ",name,port);
+void Listener::out_of_fds() {
+	/* a level-triggered listener would be woken again at once for the connection it can't
+	   accept, so: use the reserve fd to accept and close it, so the client isn't left hanging in
+	   the backlog, and stop listening for a while that doubles until an accept works again */
+	const int err = errno;
+	if(-1 != reserve_fd) {
+		::close(reserve_fd);
+		const FD shed = accept4(fd,NULL,0,SOCK_CLOEXEC);
+		if(0<=shed)
+			::close(shed);
+		reserve_fd = open("/dev/null",O_RDONLY|O_CLOEXEC); // -1 if something else got in first; retried on resume
+	}
+	backoff_millisecs = backoff_millisecs? std::min<uint32_t>(backoff_millisecs*2,MAX_BACKOFF): MIN_BACKOFF;
+	fprintf(stderr,"%s is out of fds (%s); not accepting for %u ms\n",name,strerror(err),backoff_millisecs);
+	unschedule(EPOLLIN);
+	scheduler.call_later(&backoff,backoff_millisecs);
+}
+
+void Listener::at_connection_limit() {
+	/* leave the rest in the backlog, where the kernel holds them cheaply and pushes back on the
+	   clients once it fills; the scheduler reschedules us when a connection closes */
+	if(!limited) {
+		limited = true;
+		scheduler.load_stats.accept_pauses++;
+	}
+	unschedule(EPOLLIN);
+	scheduler.limited.push_back(this);
 }
 
+void Listener::resume() {
+	if(-1 == reserve_fd)
+		reserve_fd = open("/dev/null",O_RDONLY|O_CLOEXEC);
+	schedule(EPOLLIN);
+}
+
+void Listener::Backoff::on_timer(const time64_t& now) {
+	listener.resume();
+}
+
+void Listener::dump_context(FILE* out) const {
+	fprintf(out,"Listener[%s@%s] ",name,address.describe());
+}
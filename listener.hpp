@@ -5,23 +5,48 @@
 #define LISTENER_HPP
 
 #include "task.hpp"
+#include "address.hpp"
 
 class Listener: private Task {
 public:
 	typedef void (*Factory)(Scheduler& scheduler,FD accept_fd);
-	static void create(Scheduler& scheduler,const char* name,short port,Factory factory,int backlog,bool reuse_addr=false);
+	enum Flags {
+		DEFER_ACCEPT = 1, // TCP_DEFER_ACCEPT: don't wake for a connection until its request arrives
+		FASTOPEN = 2, // TCP_FASTOPEN: a returning client's request can come with its SYN
+	};
+	// see SocketAddress for the address specs; unix socket files left by a previous run are replaced if reuse_addr
+	static void create(Scheduler& scheduler,const char* name,const char* address,Factory factory,int backlog,bool reuse_addr=false,unsigned flags=0);
+	static void create(Scheduler& scheduler,const char* name,short port,Factory factory,int backlog,bool reuse_addr=false,unsigned flags=0); // any IPv4 address
 private:
-	Listener(Scheduler& scheduler,const char* name,short port,Factory factory,int backlog,bool reuse_addr);
+	Listener(Scheduler& scheduler,const char* name,const SocketAddress& address,Factory factory,int backlog,bool reuse_addr,unsigned flags);
+	~Listener();
 	void dump_context(FILE* out) const;
 	void do_construct();
 	void read();
+	void out_of_fds();
+	void at_connection_limit();
+	void resume();
+	enum {
+		ACCEPT_BUDGET = 64, // per wakeup, so a flood of connections doesn't starve those already accepted
+		DEFER_SECS = 5,
+		MIN_BACKOFF = 50, MAX_BACKOFF = 1000, // ms
+	};
+	struct Backoff: public Timer {
+		Backoff(Listener& l): listener(l) {}
+		void on_timer(const time64_t& now);
+		Listener& listener;
+	} backoff;
 private:
 	const char* const name;
-	const short port;
+	const SocketAddress address;
 	const Factory factory;
 	const int backlog;
 	const bool reuse_addr;
+	const unsigned flags;
+	FD reserve_fd; // given up to accept and close a connection when out of fds
+	uint32_t backoff_millisecs; // 0 when not backing off
+	bool limited; // stopped at the scheduler's connection limit, and not accepted since
+	bool bound; // so a unix socket's file is ours to remove
 };
 
 #endif //LISTENER_HPP
-
@@ -0,0 +1,96 @@
+/* (c) William Edwards, 2011
+   Using the Simplified BSD License.  See LICENSE file for details */
+
+#include "mailbox.hpp"
+
+extern "C" {
+	#include <sys/eventfd.h>
+}
+
+Mailbox* Mailbox::create(Scheduler& scheduler) {
+	Mailbox* self = new Mailbox(scheduler);
+	self->construct();
+	return self;
+}
+
+Mailbox::Mailbox(Scheduler& scheduler): Task(scheduler),
+	head(NULL), wakeups(0), delivered(0), batches(0), max_batch(0) {}
+
+Mailbox::~Mailbox() {
+	if(this == scheduler.mailbox)
+		scheduler.mailbox = NULL;
+	Message* msg = head.exchange(NULL,std::memory_order_acquire);
+	while(msg) {
+		Message* next = msg->next;
+		msg->release();
+		msg = next;
+	}
+}
+
+void Mailbox::do_construct() {
+	fd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	check(fd);
+	schedule(EPOLLIN|EPOLLET);
+}
+
+void Mailbox::send(Message* msg) {
+	Message* old = head.load(std::memory_order_relaxed);
+	do
+		msg->next = old;
+	while(!head.compare_exchange_weak(old,msg,std::memory_order_release,std::memory_order_relaxed));
+	if(old) // already non-empty, so a wakeup is already on its way
+		return;
+	wakeups.fetch_add(1,std::memory_order_relaxed);
+	const uint64_t one = 1;
+	while((0 > ::write(fd,&one,sizeof(one))) && (EINTR == errno));
+}
+
+void Mailbox::read() {
+	// reset the eventfd before taking the messages, so a send that comes after we take them wakes us again
+	uint64_t count;
+	ssize_t bytes;
+	while(IO_OK == try_read(&count,sizeof(count),bytes));
+	Message* msg = head.exchange(NULL,std::memory_order_acquire);
+	if(!msg)
+		return;
+	// put the batch back in the order it was sent
+	Message* batch = NULL;
+	uint64_t n = 0;
+	while(msg) {
+		Message* next = msg->next;
+		msg->next = batch;
+		batch = msg;
+		msg = next;
+		n++;
+	}
+	batches++;
+	max_batch = std::max(max_batch,n);
+	while(batch) {
+		Message* next = batch->next;
+		try {
+			batch->deliver(scheduler);
+		} catch(Error* e) { // one bad message mustn't lose the rest
+			e->dump(this);
+			e->release();
+		} catch(...) { // e.g. a Shutdown; release the rest undelivered
+			while(batch) {
+				next = batch->next;
+				batch->release();
+				batch = next;
+			}
+			throw;
+		}
+		delivered++;
+		batch->release();
+		batch = next;
+	}
+}
+
+Mailbox::Stats Mailbox::get_stats() const {
+	Stats stats = {wakeups.load(std::memory_order_relaxed),delivered,batches,max_batch};
+	return stats;
+}
+
+void Mailbox::dump_context(FILE* out) const {
+	fprintf(out,"Mailbox ");
+}
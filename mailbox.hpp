@@ -0,0 +1,51 @@
+/* (c) William Edwards, 2011
+   Using the Simplified BSD License.  See LICENSE file for details */
+
+#ifndef MAILBOX_HPP
+#define MAILBOX_HPP
+
+#include "task.hpp"
+
+#include <atomic>
+
+class Message {
+	/* something sent to another Scheduler's Mailbox; deliver() is called on the receiving
+	   scheduler's thread, and then the message is released */
+public:
+	Message(): next(NULL) {}
+	virtual ~Message() {}
+	virtual void deliver(Scheduler& scheduler) = 0;
+	virtual void release() { delete this; } // also called for messages that are never delivered
+private:
+	friend class Mailbox;
+	Message* next;
+};
+
+class Mailbox: private Task {
+	/* a multiple-producer, single-consumer queue of Messages for a Scheduler.  Any thread may send();
+	   the scheduler drains everything that has arrived in one batch per loop iteration.  The wakeup is
+	   an eventfd that is only written when the mailbox goes from empty to non-empty, so a burst of sends
+	   costs one write.  Senders must stop sending before the scheduler is destroyed */
+public:
+	static Mailbox* create(Scheduler& scheduler);
+	void send(Message* msg); // thread-safe
+	struct Stats {
+		uint64_t wakeups; // eventfd writes
+		uint64_t delivered;
+		uint64_t batches;
+		uint64_t max_batch;
+	};
+	Stats get_stats() const; // only meaningful on the receiving scheduler's thread
+private:
+	Mailbox(Scheduler& scheduler);
+	~Mailbox();
+	void dump_context(FILE* out) const;
+	void do_construct();
+	void read();
+private:
+	std::atomic<Message*> head; // a stack, newest first; reversed when drained
+	std::atomic<uint64_t> wakeups;
+	uint64_t delivered, batches, max_batch;
+};
+
+#endif //MAILBOX_HPP
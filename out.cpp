@@ -7,6 +7,8 @@
 #include <ctype.h>
 #include <string.h>
 #include <stdarg.h>
+#include <new>
+#include <algorithm>
 
 Out::Out(const void* p,size_t l):  next(NULL), ptr(p), len(l), ofs(0) {}
 
@@ -31,15 +33,32 @@ void Out::dump_debug(FILE* out) const {
 	}
 }
 
-bool Out::async_write(Task* task) {
-	const char* c = reinterpret_cast<const char*>(ptr);
+IoStatus Out::async_write(Task* task) {
 	size_t written;
-	const bool completed = task->do_async_write(c+ofs,len-ofs,written);
-	ofs += written;
-	if(!completed)
-		return false;
-	assert(ofs == len);
-	return true;
+	if(ptr) {
+		const char* c = reinterpret_cast<const char*>(ptr);
+		const IoStatus status = task->do_async_write(c+ofs,len-ofs,written);
+		ofs += written;
+		assert((IO_OK != status) || (ofs == len));
+		return status;
+	}
+	while(ofs < len) {
+		iovec iov[MAX_IOV];
+		const IoStatus status = task->do_async_writev(iov,get_iov(iov,MAX_IOV),written);
+		ofs += written;
+		if(IO_OK != status)
+			return status;
+	}
+	return IO_OK;
+}
+
+int Out::get_iov(iovec* iov,int max) const {
+	assert(ptr && (0 < max));
+	if(ofs == len)
+		return 0;
+	iov->iov_base = const_cast<char*>(reinterpret_cast<const char*>(ptr)+ofs);
+	iov->iov_len = len-ofs;
+	return 1;
 }
 
 OutConst::OutConst(const void* ptr,size_t len): Out(ptr,len) {}
@@ -59,6 +78,35 @@ void OutFree::release() {
 	delete this;
 }
 
+OutCopy::OutCopy(BufferPool* p,size_t c): Out(this+1,0), pool(p), capacity(c) {}
+
+OutCopy* OutCopy::create(BufferPool& pool,const void* ptr,size_t len) {
+	OutCopy* copy;
+	if(len <= POOLED-sizeof(OutCopy))
+		copy = new(pool.alloc(POOLED)) OutCopy(&pool,POOLED-sizeof(OutCopy));
+	else if(void* mem = malloc(sizeof(OutCopy)+len))
+		copy = new(mem) OutCopy(NULL,len);
+	else
+		ThrowInternalError("out of memory");
+	copy->append(ptr,len);
+	return copy;
+}
+
+void OutCopy::append(const void* p,size_t l) {
+	assert(l <= spare());
+	memcpy(reinterpret_cast<uint8_t*>(this+1)+len,p,l);
+	len += l;
+}
+
+void OutCopy::release() {
+	BufferPool* const p = pool;
+	this->~OutCopy();
+	if(p)
+		p->release(this,POOLED);
+	else
+		free(this);
+}
+
 ResizeableBuffer::ResizeableBuffer(void*& p,size_t& l,size_t initial_capacity): ptr(reinterpret_cast<char*&>(p)), len(l), capacity(0) {
 	ptr = NULL;
 	len = 0;
@@ -98,9 +146,9 @@ ResizeableBuffer& ResizeableBuffer::nprintf(size_t maxlen,const char* const fmt,
 }
 
 void ResizeableBuffer::ensure_capacity(size_t needed) {
-	//### if profiling says we do lots of small reallocs, we can always do doubling
+	// doubling, so that lots of small appends aren't quadratic
 	if(len+needed>capacity)
-		resize(len+needed);
+		resize(std::max(len+needed,capacity*2));
 }
 
 void ResizeableBuffer::resize(size_t new_capacity) {
@@ -137,6 +185,13 @@ int ResizeableBuffer::find(const char* str,int start) const {
 	return -1; // not found
 }
 
+ssize_t ResizeableBuffer::find(const void* needle,size_t needle_len,size_t start) const {
+	if(start > len)
+		return -1;
+	const char* found = reinterpret_cast<const char*>(memmem(ptr+start,len-start,needle,needle_len));
+	return found? (found-ptr): -1;
+}
+
 bool ResizeableBuffer::starts_with(const char* str) const {
 	const size_t slen = strlen(str);
 	if(len >= slen)
@@ -162,47 +217,6 @@ void ResizeableBuffer::set_length(size_t explicit_len) {
 	len = explicit_len;
 }
 
-const char* BufferReader::ptr() const {
-	assert(stop >= start);
-	assert(stop <= in.length());
-	return in.c_str() + start;
-}
-
-void BufferReader::next() {
-	start = stop;
-	assert(start <= in.length());
-}
-
-void BufferReader::skip_whitespace() {
-	while((stop < in.length()) && (*reinterpret_cast<const char*>(in.data(stop)) <= ' '))
-		stop++;
-	next();
-}
-
-size_t BufferReader::next(const void* terminator,size_t terminator_len) {
-	next();
-	if(start >= in.length())
-		return 0;
-	const char* buf = reinterpret_cast<const char*>(in.data());
-	if(!terminator_len) { // special case to look for the \0 character
-		for(;buf[stop]; stop++)
-			if(stop == in.length()) {
-				stop = start;
-				return 0;
-			}
-		return stop-start;
-	}
-	const char* found = reinterpret_cast<const char*>(memmem(buf+start,in.length()-start,terminator,terminator_len));
-	if(!found)
-		return 0;
-	stop = (found-buf)+terminator_len;
-	return (stop-start);
-}
-
-size_t BufferReader::next(const char* terminator) {
-	return next(terminator,strlen(terminator));
-}
-
 Buffer::Buffer(size_t initial_capacity): ResizeableBuffer(Buffer::ptr,Buffer::len,initial_capacity) {}
 
 OutBuffer::OutBuffer(size_t initial_capacity): Out(NULL,0),
@@ -9,10 +9,12 @@
 #include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "error.hpp"
 
 class Task;
+class BufferPool;
 
 template<typename T> T extract_be(const void* ptr,size_t ofs,size_t len) {
 	assert(len <= sizeof(T));
@@ -36,15 +38,17 @@ struct Out {
 	void dump_debug(FILE* out) const;
 	Out* next; // so sue me
 	friend class Task;
+	enum { MAX_IOV = 64 }; // gathered per writev
 protected:
 	Out(const void* ptr,size_t len);
 	virtual ~Out() {}
+	virtual int get_iov(iovec* iov,int max) const; // what is left to write from ofs; returns how many were filled
 protected:
-	const void* const ptr;
-	const size_t len;
+	const void* const ptr; // NULL if not contiguous
+	size_t len;
 	size_t ofs;
 private:
-	bool async_write(Task* task);
+	IoStatus async_write(Task* task);
 };
 
 class OutConst: public Out {
@@ -71,6 +75,23 @@ private:
 	~OutRefCnt() {}
 };
 
+class OutCopy: public Out {
+	/* a copy of output that has to wait, sharing one allocation with its header.  Small copies get a
+	   pooled buffer with spare room, so that later small writes can be appended while it is the last
+	   in the queue rather than each needing a node of its own */
+public:
+	enum { POOLED = 4096 }; // bytes, header included
+	static OutCopy* create(BufferPool& pool,const void* ptr,size_t len);
+	size_t spare() const { return capacity-len; }
+	void append(const void* ptr,size_t len);
+	void release();
+private:
+	OutCopy(BufferPool* pool,size_t capacity);
+	~OutCopy() {}
+	BufferPool* const pool; // NULL if malloced
+	const size_t capacity;
+};
+
 template<typename T> class OutDelete: public Out {
 public:
 	OutDelete(const T& ptr,size_t len=sizeof(T)): Out(&ptr,len) {}
@@ -102,6 +123,9 @@ public:
 	void set_length(size_t explicit_len);
 	bool starts_with(const char* str) const;
 	int find(const char* str,int start=0) const; //-1 if not found
+	ssize_t find(const void* needle,size_t needle_len,size_t start) const; // -1 if not found
+	char at(size_t ofs) const { assert(ofs < len); return ptr[ofs]; }
+	const char* range(size_t ofs,size_t) { return c_str()+ofs; } // terminated at the end of the buffer
 	bool ends_with(const char* str) const;
 	void reset(size_t max_size);
 	const char* c_str();
@@ -129,20 +153,58 @@ template<typename T> ResizeableBuffer& ResizeableBuffer::write_be(const T& t,siz
 	return *this;
 }
 
-class BufferReader {
+template<class B> class BasicBufferReader {
+	/* tokenises a ResizeableBuffer or an IOBuf */
 public:
-	BufferReader(ResizeableBuffer& buffer): in(buffer), start(0), stop(0)  {}
+	BasicBufferReader(B& buffer): in(buffer), start(0), stop(0)  {}
 	void next();
 	void skip_whitespace();
-	size_t next(const void* terminator,size_t terminator_len);
-	size_t next(const char* terminator);
+	size_t next(const void* terminator,size_t terminator_len); // 0 terminator_len stops at a \0
+	size_t next(const char* terminator) { return next(terminator,strlen(terminator)); }
 	inline size_t remaining() const { return in.length() - stop; } 
-	const char* ptr() const;
+	const char* ptr() const; // the current token, contiguous
 private:
-	ResizeableBuffer& in;
+	B& in;
 	size_t start, stop;
 };
 
+typedef BasicBufferReader<ResizeableBuffer> BufferReader;
+
+template<class B> const char* BasicBufferReader<B>::ptr() const {
+	assert(stop >= start);
+	assert(stop <= in.length());
+	return in.range(start,stop-start);
+}
+
+template<class B> void BasicBufferReader<B>::next() {
+	start = stop;
+	assert(start <= in.length());
+}
+
+template<class B> void BasicBufferReader<B>::skip_whitespace() {
+	while((stop < in.length()) && (in.at(stop) <= ' '))
+		stop++;
+	next();
+}
+
+template<class B> size_t BasicBufferReader<B>::next(const void* terminator,size_t terminator_len) {
+	next();
+	if(start >= in.length())
+		return 0;
+	if(!terminator_len) { // special case to look for the \0 character
+		const ssize_t found = in.find("",1,start);
+		if(0 > found)
+			return 0;
+		stop = found;
+		return stop-start;
+	}
+	const ssize_t found = in.find(terminator,terminator_len,start);
+	if(0 > found)
+		return 0;
+	stop = found+terminator_len;
+	return (stop-start);
+}
+
 class Buffer: public ResizeableBuffer {
 public:
 	Buffer(size_t initial_capacity);
@@ -0,0 +1,92 @@
+/* (c) William Edwards, 2011
+   Using the Simplified BSD License.  See LICENSE file for details */
+
+#include "ratelimit.hpp"
+
+#include <algorithm>
+#include <endian.h>
+
+static void prefix_mask(uint64_t mask[2],unsigned bits) {
+	// in network order, as the address bytes are
+	bits = std::min(bits,128U);
+	for(int i=0; i<2; i++, bits -= std::min(bits,64U))
+		mask[i] = htobe64(bits >= 64? ~0ULL: bits? ~0ULL << (64-bits): 0);
+}
+
+RateLimiter::RateLimiter(uint32_t rate,uint32_t burst,size_t buckets,unsigned v4_prefix,unsigned v6_prefix):
+	sets(NULL), mask(0), hand(0),
+	interval(rate? microsecs_to_time64(1000000)/rate: 0),
+	tolerance(interval*(std::max<uint32_t>(burst,1)-1)) {
+	if(!rate)
+		ThrowInternalError("a rate limit of 0 a second would never let anything through");
+	size_t count = 1;
+	while(count*WAYS < buckets)
+		count *= 2;
+	sets = new Set[count]();
+	mask = count-1;
+	prefix_mask(v4_mask,96+std::min(v4_prefix,32U));
+	prefix_mask(v6_mask,v6_prefix);
+	seed = (time64_now() ^ reinterpret_cast<uintptr_t>(this)) * 0x9e3779b97f4a7c15ULL; // so set collisions can't be planned
+	memset(&stats,0,sizeof(stats));
+}
+
+RateLimiter::~RateLimiter() {
+	delete[] sets;
+}
+
+inline uint64_t RateLimiter::hash(const IPAddress& addr) const {
+	uint64_t half[2];
+	memcpy(half,addr.get(),sizeof(half));
+	const uint64_t* m = (!half[0] && ((be64toh(half[1]) >> 32) == 0xffff))? v4_mask: v6_mask; // ::ffff:a.b.c.d
+	uint64_t h = (((half[0] & m[0]) ^ seed) * 0x9e3779b97f4a7c15ULL) ^ (half[1] & m[1]);
+	// murmur3's finalizer, as an IPv4 address is all in the top half of half[1] and the set is picked by the bottom bits
+	h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdULL;
+	h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return (h & ~REFERENCED) | 1; // never 0, which is unused
+}
+
+inline RateLimiter::Bucket& RateLimiter::find(uint64_t key,const time64_t& now) {
+	Set& set = sets[(key >> 1) & mask];
+	Bucket* victim = NULL;
+	for(int i=0; i<WAYS; i++) {
+		Bucket& b = set.buckets[i];
+		if((b.key & ~REFERENCED) == key) {
+			b.key |= REFERENCED;
+			return b;
+		}
+		if(!victim && (b.full <= now)) // unused, or full again so forgetting it loses nothing
+			victim = &b;
+	}
+	if(!victim) {
+		for(;;) { // CLOCK: one that hasn't been used since the hand last passed
+			Bucket& b = set.buckets[hand++ % WAYS];
+			if(!(b.key & REFERENCED)) {
+				victim = &b;
+				break;
+			}
+			b.key &= ~REFERENCED;
+		}
+		stats.evictions++;
+	}
+	victim->key = key; // not referenced until it's used again, so one-off clients go first
+	victim->full = 0;
+	return *victim;
+}
+
+time64_t RateLimiter::take(const IPAddress& addr,const time64_t& now,const time64_t& max_wait) {
+	Bucket& b = find(hash(addr),now);
+	const time64_t full = std::max(b.full,now);
+	const time64_t wait = full-tolerance-now;
+	if(wait <= 0) {
+		b.full = full+interval;
+		stats.allowed++;
+		return 0;
+	}
+	if(wait <= max_wait) {
+		b.full = full+interval;
+		stats.delayed++;
+	} else
+		stats.limited++;
+	return wait;
+}
@@ -0,0 +1,56 @@
+/* (c) William Edwards, 2011
+   Using the Simplified BSD License.  See LICENSE file for details */
+
+#ifndef RATELIMIT_HPP
+#define RATELIMIT_HPP
+
+#include "address.hpp"
+#include "time.hpp"
+#include "error.hpp"
+
+class RateLimiter {
+	/* a token bucket per client address, or per prefix of addresses, refilling at rate a second
+	   up to burst.  A bucket is kept as just the time it will next be full (GCRA), so taking a
+	   token is a compare and an add.  The buckets are in a fixed table of cache-line sets of
+	   four, so a check touches one line; when a set is full a bucket that has refilled is
+	   replaced first, then one that CLOCK's second chance finds hasn't been used lately.  A
+	   replaced bucket starts full, so clients can only gain from an eviction, not lose.
+	   Only for use on one thread, e.g. the scheduler's */
+public:
+	RateLimiter(uint32_t rate,uint32_t burst,size_t buckets = 4096,unsigned v4_prefix = 32,unsigned v6_prefix = 64);
+	~RateLimiter();
+	/* takes a token for addr: 0 if there was one, else how long until there will be.  If that is
+	   no longer than max_wait the token is taken anyway, reserved for then; otherwise nothing is */
+	time64_t take(const IPAddress& addr,const time64_t& now,const time64_t& max_wait = 0);
+	struct Stats {
+		uint64_t allowed;
+		uint64_t delayed; // given a reserved token to wait for
+		uint64_t limited; // turned away
+		uint64_t evictions; // of buckets that weren't yet full
+	};
+	const Stats& get_stats() const { return stats; }
+private:
+	RateLimiter(const RateLimiter&);
+	void operator=(const RateLimiter&);
+	enum { WAYS = 4 };
+	static const uint64_t REFERENCED = 1ULL << 63; // CLOCK's bit, kept in the key
+	struct Bucket {
+		uint64_t key; // 0 if unused
+		time64_t full; // the theoretical arrival time, when the bucket will be full again
+	};
+	struct alignas(64) Set {
+		Bucket buckets[WAYS];
+	};
+	uint64_t hash(const IPAddress& addr) const;
+	Bucket& find(uint64_t key,const time64_t& now);
+	Set* sets;
+	size_t mask; // sets-1
+	unsigned hand; // CLOCK's
+	const time64_t interval; // between tokens
+	const time64_t tolerance; // how far ahead of now a bucket can be and still have a token
+	uint64_t v4_mask[2], v6_mask[2]; // applied to an address before hashing, for the prefix
+	uint64_t seed;
+	Stats stats;
+};
+
+#endif //RATELIMIT_HPP
@@ -2,8 +2,11 @@
    Using the Simplified BSD License.  See LICENSE file for details */
 
 #include "task.hpp"
+#include "mailbox.hpp"
+#include "workers.hpp"
 #include <algorithm>
 #include <set>
+#include <atomic>
 #include <sched.h>
 
 //#define CHG_PRIO
@@ -22,11 +25,24 @@ extern "C" {
 	#include <sys/resource.h>
 }
 
-Scheduler::Scheduler(): max_events(1000), events(new epoll_event[1000]),
-	epoll_fd(epoll_create1(EPOLL_CLOEXEC)), current_task(NULL), tick(NULL),
-	close_list(NULL), tasks(NULL), timeouts(NULL), timeouts_enabled(true),
-	shutting_down(false) {
+#ifndef SO_PREFER_BUSY_POLL
+	#define SO_PREFER_BUSY_POLL 69 // linux 5.11; older headers don't have it
+#endif
+
+Scheduler::Scheduler(): max_events(MIN_EVENTS), events(new epoll_event[MIN_EVENTS]), quiet_waits(0),
+	epoll_fd(epoll_create1(EPOLL_CLOEXEC)), time_source(time64_now), now(0), next_wall_time(0),
+	current_task(NULL), close_list(NULL), tasks(NULL), posted(NULL), posted_tail(&posted),
+	timeouts_enabled(true), read_budget(0), slice_read_end(0), request_budget(0), slice_requests(0),
+	shuffle(false), shuffle_seed(2463534242U), shutting_down(false), mailbox(NULL),
+	busy_poll(0), socket_busy_poll(0), socket_prefer_busy_poll(false),
+	max_connections(0), max_requests(0), max_lag(0),
+	idle_head(NULL), idle_tail(NULL), reap_connections(0), reap_buffer_bytes(0),
+	connection_rate_limit(NULL), request_rate_limit(NULL), rate_limit_max_delay(0), prepared_fd(-1) {
 	check(epoll_fd);
+	memset(&out_stats,0,sizeof(out_stats));
+	memset(&poll_stats,0,sizeof(poll_stats));
+	memset(&load_stats,0,sizeof(load_stats));
+	update_clock();
 }
 
 Scheduler::~Scheduler() {
@@ -41,88 +57,426 @@ Scheduler::~Scheduler() {
 		tmp->del_ok = true;
 		delete tmp;
 	}
+	// anything else still pending belongs to someone else; just forget it
+	while(posted)
+		unpost(posted);
+	while(!timers.empty())
+		cancel(timers.back().timer);
 	close(epoll_fd);              
 	delete[] events;
 }
 
-template<typename T> T min(const T& a,const T& b) {
-	return (a<b? a: b);
+Mailbox& Scheduler::get_mailbox() {
+	if(!mailbox)
+		mailbox = Mailbox::create(*this);
+	return *mailbox;
+}
+
+void Scheduler::set_time_source(TimeSource ts) {
+	time_source = ts;
+	next_wall_time = 0;
+	update_clock();
+}
+
+void Scheduler::update_clock() {
+	now = time_source();
+	if(now >= next_wall_time) {
+		// due again when the wall clock's second ticks over, so the Date is never a second stale
+		timespec wall;
+		check(clock_gettime(CLOCK_REALTIME,&wall));
+		wall_time = wall.tv_sec;
+		format_http_date(wall_time,http_date);
+		next_wall_time = now + microsecs_to_time64((1000000000L-wall.tv_nsec+999)/1000);
+	}
+}
+
+void Scheduler::set_busy_poll(uint32_t microsecs) {
+	busy_poll = microsecs_to_time64(microsecs);
+}
+
+void Scheduler::set_socket_busy_poll(uint32_t microsecs,bool prefer) {
+	socket_busy_poll = microsecs;
+	socket_prefer_busy_poll = microsecs && prefer;
+}
+
+Scheduler::PollStats Scheduler::get_poll_stats() const {
+	PollStats stats = poll_stats;
+	stats.max_events = max_events;
+	return stats;
+}
+
+void Scheduler::set_admission_limits(uint32_t connections,uint32_t requests,uint32_t lag_millisecs) {
+	max_connections = connections;
+	max_requests = requests;
+	max_lag = millisecs_to_time64(lag_millisecs);
+}
+
+void Scheduler::set_idle_reaping(uint32_t max_connections,size_t max_buffer_bytes) {
+	reap_connections = max_connections;
+	reap_buffer_bytes = max_buffer_bytes;
+}
+
+void Scheduler::reap_idle() {
+	for(int batch = REAP_BATCH; idle_head; ) {
+		if(!reap_connections || (load_stats.connections <= reap_connections)) {
+			// just memory: a batch at a time, as idle tasks have already given their buffers back
+			if(!reap_buffer_bytes || (buffers.get_bytes_in_use() <= reap_buffer_bytes) || !batch--)
+				break;
+		}
+		Task* task = idle_head;
+		if(task->Log(LOG_CONN)) {
+			task->dump_context(stdout);
+			fprintf(stdout,"reaped whilst idle\n");
+		}
+		task->close(); // which takes it off the list
+		load_stats.reaped++;
+	}
+}
+
+void Scheduler::set_rate_limits(RateLimiter* connections,RateLimiter* requests,uint32_t max_delay_millisecs) {
+	connection_rate_limit = connections;
+	request_rate_limit = requests;
+	rate_limit_max_delay = millisecs_to_time64(max_delay_millisecs);
+}
+
+bool Scheduler::admit_request() {
+	if((max_requests && (load_stats.requests >= max_requests)) || (max_lag && (load_stats.lag > max_lag))) {
+		load_stats.shed++;
+		return false;
+	}
+	load_stats.requests++;
+	return true;
+}
+
+void Scheduler::end_request() {
+	assert(load_stats.requests);
+	load_stats.requests--;
+}
+
+void Scheduler::connection_closed() {
+	load_stats.connections--;
+	if(!limited.empty() && !at_connection_limit()) {
+		for(size_t i=0; i<limited.size(); i++)
+			limited[i]->schedule(EPOLLIN); // level-triggered, so woken if there are connections waiting
+		limited.clear();
+	}
+}
+
+int Scheduler::get_wait_timeout() const {
+	if(!ready.empty() || posted)
+		return 0;
+	if(timers.empty())
+		return -1; //infinite
+	// round up, else we'd spin until the last sub-millisecond passes
+	const time64_t wait = std::max<time64_t>(0,timers[0].due-now);
+	return time64_to_millisecs(wait + millisecs_to_time64(1) - 1);
+}
+
+void Scheduler::fit_events(int nfds) {
+	// grow at once if the events didn't all fit; shrink only if it has been oversized for a while
+	int fit = max_events;
+	if(nfds == max_events) {
+		quiet_waits = 0;
+		if(max_events < MAX_EVENTS)
+			fit = max_events*2;
+	} else if((nfds < max_events/4) && (max_events > MIN_EVENTS)) {
+		if(++quiet_waits == SHRINK_WAITS) {
+			quiet_waits = 0;
+			fit = max_events/2;
+		}
+	} else
+		quiet_waits = 0;
+	if(fit != max_events) {
+		epoll_event* resized = new epoll_event[fit];
+		delete[] events;
+		events = resized;
+		max_events = fit;
+	}
 }
 
 void Scheduler::run() {
-	const time64_t tick_interval = millisecs_to_time64(1000);
-	time64_t next_tick = (time64_now() + tick_interval);
-	while(tasks) {
-		int timeout = -1; //infinite
-		if(tick || timeouts) {
-			now = time64_now();
-			if(tick) {
-				if(now >= next_tick)
-					next_tick = min<time64_t>(tick->tick(now),1);
-				timeout = time64_to_millisecs(next_tick-now);
+	update_clock();
+	try {
+		while(tasks) {
+			int timeout = get_wait_timeout();
+			//printf("ready... (%d)\n",timeout);
+
+			int nfds = 0;
+			if(timeout && busy_poll) {
+				// spin, but not past the first timer
+				const time64_t spin_end = time_source() +
+					((0 < timeout)? std::min(busy_poll,millisecs_to_time64(timeout)): busy_poll);
+				poll_stats.spins++;
+				do {
+					check(nfds = epoll_wait(epoll_fd,events,max_events,0));
+				} while(!nfds && (time_source() < spin_end));
+				if(nfds)
+					poll_stats.spin_hits++;
+				else {
+					update_clock();
+					timeout = get_wait_timeout();
+				}
 			}
-			if(timeouts_enabled) {
-				while(timeouts && (now >= timeouts->timeout.due)) {
-					assert(!timeouts->closed); // ignore half-closed, so don't use is_closed()
-					timeouts->handle_timeout(now);
-					timeouts->close(); // unlinks, and resets timeouts pointer
+			if(!nfds) {
+				if(timeout)
+					poll_stats.sleeps++;
+				check(nfds = epoll_wait(epoll_fd,events,max_events,timeout));
+			}
+			if(nfds)
+				poll_stats.waits++;
+			update_clock();
+			run_timers();
+			if(shuffle)
+				for(int i=nfds-1; i>0; i--) {
+					shuffle_seed ^= shuffle_seed << 13; // xorshift32
+					shuffle_seed ^= shuffle_seed >> 17;
+					shuffle_seed ^= shuffle_seed << 5;
+					std::swap(events[i],events[shuffle_seed%(i+1)]);
 				}
-				if(timeouts) {
-					int next_timeout = time64_to_millisecs(timeouts->timeout.due-now);
-					if(tick)
-						timeout = min(timeout,next_timeout);
-					else
-						timeout = next_timeout;
+			for(int i=0; i<nfds; i++) {
+				Task* task = reinterpret_cast<Task*>(events[i].data.ptr);
+				uint32_t flags = events[i].events;
+				if(task->ready) // it gets its read on the ready list; don't give it two slices
+					flags &= ~EPOLLIN;
+				if((EPOLLIN|EPOLLOUT) & flags & ~task->events) { // see Task::update_interest()
+					flags &= (task->events|~(EPOLLIN|EPOLLOUT));
+					if(!flags)
+						poll_stats.filtered++;
 				}
+				if(!task->closed && flags)
+					dispatch(task,flags);
+			}
+			fit_events(nfds);
+			run_ready();
+			if(idle_head && (reap_connections || reap_buffer_bytes))
+				reap_idle();
+			// delete those marked as closed
+			while(close_list) {
+				Task* tmp = close_list;
+				close_list = close_list->next_close;
+				tmp->del_ok = true;
+				delete tmp;
 			}
+			load_stats.lag = time_source()-now;
+			load_stats.max_lag = std::max(load_stats.max_lag,load_stats.lag);
 		}
-		//printf("ready... (%d)\n",timeout);
+	} catch(Shutdown* sd) {
+		current_task = NULL;
+		fprintf(stderr,"shutting down: %s\n",sd->msg);
+	}
+}
 
-		int nfds;
-		check(nfds = epoll_wait(epoll_fd,events,max_events,timeout));
-		now = time64_now();
-		for(int i=0; i<nfds; i++) {
-			current_task = reinterpret_cast<Task*>(events[i].data.ptr);
-			if(current_task->closed)
-				continue;
-			//current_task->dump_context(stdout);
-			//printf("is running...\n");
-			try {
-				current_task->run(events[i].events);
+void Scheduler::dispatch(Task* task,uint32_t flags) {
+	current_task = task;
+	//current_task->dump_context(stdout);
+	//printf("is running...\n");
+	try {
+		task->run(flags);
+		current_task = NULL;
+		return;
+	} catch(Error* e) {
+		if(task->Log(LOG_CRITICAL)) {
+			e->dump(this);
+			e->release();
+		}
+	} catch(std::exception& e) {
+		if(task->Log(LOG_CRITICAL))
+			fprintf(stderr,"std::exception: %s\n",e.what());
+	} catch(Shutdown* sd) {
+		throw;
+	} catch(...) {
+		task->dump_context(stderr);
+		fprintf(stderr,"unexpected exception!\n");
+	}
+	task->close();
+	current_task = NULL;
+}
+
+void Scheduler::make_ready(Task* task) {
+	if(task->ready)
+		return;
+	task->ready = true;
+	ready.push_back(task);
+}
+
+void Scheduler::run_ready() {
+	// whatever gets posted or made ready whilst these run waits for the next iteration
+	if(!ready.empty()) {
+		std::vector<Task*> running;
+		running.swap(ready);
+		for(size_t i=0; i<running.size(); i++) {
+			Task* task = running[i];
+			if(!task) // deleted since
 				continue;
-			} catch(Error* e) {
-				if(current_task->Log(LOG_CRITICAL)) {
-					e->dump(this);
-					e->release();
-				}
-			} catch(std::exception& e) {
-				if(current_task->Log(LOG_CRITICAL))
-					fprintf(stderr,"std::exception: %s\n",e.what());
-			} catch(Shutdown* sd) {
-				fprintf(stderr,"shutting down: %s\n",sd->msg);
-				// exit
-				return;
-			} catch(...) {
-				current_task->dump_context(stderr);
-				fprintf(stderr,"unexpected exception!\n");
-			}
-			current_task->close();
+			task->ready = false;
+			if(!task->closed)
+				dispatch(task,EPOLLIN);
 		}
-		current_task = NULL;
-		// delete those marked as closed
-		while(close_list) {
-			Task* tmp = close_list;
-			close_list = close_list->next_close;
-			tmp->del_ok = true;
-			delete tmp;
+		if(ready.empty()) // keep the capacity
+			ready.swap(running), ready.clear();
+	}
+	Deferred* deferred = posted;
+	posted = NULL;
+	posted_tail = &posted;
+	while(deferred) {
+		Deferred* next = deferred->next;
+		deferred->scheduler = NULL;
+		deferred->next = NULL;
+		try {
+			deferred->do_deferred();
+		} catch(Error* e) {
+			e->dump(this);
+			e->release();
+		}
+		deferred = next;
+	}
+}
+
+void Scheduler::post(Deferred* deferred) {
+	if(deferred->scheduler)
+		return;
+	deferred->scheduler = this;
+	*posted_tail = deferred;
+	posted_tail = &deferred->next;
+}
+
+void Scheduler::unpost(Deferred* deferred) {
+	if(deferred->scheduler != this)
+		return;
+	for(Deferred** d = &posted; *d; d = &(*d)->next)
+		if(*d == deferred) {
+			*d = deferred->next;
+			if(posted_tail == &deferred->next)
+				posted_tail = d;
+			break;
+		}
+	deferred->scheduler = NULL;
+	deferred->next = NULL;
+}
+
+Deferred::~Deferred() {
+	if(scheduler)
+		scheduler->unpost(this);
+}
+
+void Scheduler::call_later(Timer* timer,uint32_t millisecs) {
+	timer->interval = 0;
+	set_timer(timer,now+millisecs_to_time64(millisecs));
+}
+
+void Scheduler::call_every(Timer* timer,uint32_t millisecs) {
+	timer->interval = std::max<time64_t>(1,millisecs_to_time64(millisecs));
+	set_timer(timer,now+timer->interval);
+}
+
+void Scheduler::set_timer(Timer* timer,time64_t due) {
+	if(!timer->scheduler) {
+		timer->scheduler = this;
+		timer->slot = timers.size();
+		TimerSlot slot = {due, timer};
+		timers.push_back(slot);
+		sift_up(timer->slot);
+	} else {
+		assert(this == timer->scheduler);
+		const bool sooner = (due < timers[timer->slot].due);
+		timers[timer->slot].due = due;
+		if(sooner)
+			sift_up(timer->slot);
+		else
+			sift_down(timer->slot);
+	}
+}
+
+void Scheduler::cancel(Timer* timer) {
+	if(timer->scheduler != this)
+		return;
+	const size_t slot = timer->slot;
+	timer->scheduler = NULL;
+	if(slot != timers.size()-1) {
+		timers[slot] = timers.back();
+		timers[slot].timer->slot = slot;
+		timers.pop_back();
+		sift_up(slot);
+		sift_down(slot);
+	} else
+		timers.pop_back();
+}
+
+void Scheduler::sift_up(size_t slot) {
+	const TimerSlot moving = timers[slot];
+	while(slot) {
+		const size_t parent = (slot-1)/2;
+		if(timers[parent].due <= moving.due)
+			break;
+		timers[slot] = timers[parent];
+		timers[slot].timer->slot = slot;
+		slot = parent;
+	}
+	timers[slot] = moving;
+	moving.timer->slot = slot;
+}
+
+void Scheduler::sift_down(size_t slot) {
+	const TimerSlot moving = timers[slot];
+	const size_t count = timers.size();
+	for(;;) {
+		size_t child = slot*2+1;
+		if(child >= count)
+			break;
+		if((child+1 < count) && (timers[child+1].due < timers[child].due))
+			child++;
+		if(moving.due <= timers[child].due)
+			break;
+		timers[slot] = timers[child];
+		timers[slot].timer->slot = slot;
+		slot = child;
+	}
+	timers[slot] = moving;
+	moving.timer->slot = slot;
+}
+
+void Scheduler::run_timers() {
+	while(!timers.empty() && (timers[0].due <= now)) {
+		Timer* timer = timers[0].timer;
+		// rearm or remove it first, so on_timer() is free to cancel or rearm it itself
+		if(timer->interval) {
+			time64_t next = timers[0].due+timer->interval;
+			if(next <= now) // fallen behind; skip those missed rather than firing them in a burst
+				next = now+timer->interval;
+			set_timer(timer,next);
+		} else
+			cancel(timer);
+		try {
+			timer->on_timer(now);
+		} catch(Error* e) {
+			e->dump(this);
+			e->release();
 		}
 	}
 }
 
+Timer::~Timer() {
+	cancel();
+}
+
+void Timer::cancel() {
+	if(scheduler)
+		scheduler->cancel(this);
+}
+
 void Scheduler::enable_timeouts(bool enabled) {
 	timeouts_enabled = enabled;
 }
 
+void Scheduler::set_slice_budget(uint32_t bytes,uint16_t requests) {
+	read_budget = bytes;
+	request_budget = requests;
+}
+
+void Scheduler::set_shuffle(bool enabled) {
+	shuffle = enabled;
+}
+
 void Scheduler::dump_context(FILE* out) const {
 	fprintf(out,"Scheduler ");
 	if(current_task)
@@ -131,33 +485,95 @@ void Scheduler::dump_context(FILE* out) const {
 
 Task::Link::Link(): prev(NULL), next(NULL) {}
 
-Task::Timeout::Timeout(): due(0) {
-	read.due = write.due = 0;
+Task::Timeout::Timeout(Task& t): task(t), read_due(0), write_due(0), deadline(0), read_millisecs(0), write_millisecs(0) {}
+
+time64_t Task::Timeout::get_due() const {
+	// nothing out, so don't care about write timeout
+	const time64_t write = (task.out? write_due: 0);
+	time64_t due = deadline;
+	if(read_due && (!due || (read_due < due)))
+		due = read_due;
+	if(write && (!due || (write < due)))
+		due = write;
+	return due;
 }
 
-Task::Task(Scheduler& s,Task* parent): fd(-1), scheduler(s), out(NULL), half_close(NULL),
-	log(0U), logMask(0U),tid(nexttid()),
-	next_close(NULL), del_ok(false), closed(false), eoinput(false),
-	sated(true), totalWritten(0), totalRead(0),
-	tree_parent(parent), tree_first_child(NULL), tree_next_sibling(NULL),
-	read_ahead_buffer(NULL), read_ahead_ofs(0), read_ahead_len(0),
-	write_buffer(NULL), write_buffer_len(0), write_buffer_maxlen(0) {
-	memset(&event,0,sizeof(event));
-	event.data.ptr = this;
-	event.events = 0;
+void Task::Timeout::on_timer(const time64_t& now) {
+	// the task doesn't move its timer every time it re-arms a timeout, so it can be early
+	const time64_t due = get_due();
+	if(!due)
+		return;
+	if(due > now) {
+		task.scheduler.set_timer(this,due);
+		return;
+	}
+	assert(!task.closed); // ignore half-closed, so don't use is_closed()
+	Cleanup<Task,CleanupClose> closer(&task); // the scheduler always closes a timed-out task
+	if(deadline && (now >= deadline))
+		task.scheduler.load_stats.deadlines++;
+	task.handle_timeout(now);
+}
+
+struct Task::Cold {
+	Cold(): log(0U), logMask(0U), tree_parent(NULL), tree_first_child(NULL), tree_next_sibling(NULL), refs(NULL) {}
+	unsigned log, logMask;
+	Task* tree_parent;
+	Task* tree_first_child;
+	Task* tree_next_sibling;
+	TaskRef* refs;
+};
+
+void TaskRef::unwatch() {
+	if(!task)
+		return;
+	if(prev)
+		prev->next = next;
+	else
+		task->cold->refs = next;
+	if(next)
+		next->prev = prev;
+	task = NULL;
+	prev = next = NULL;
+}
+
+void Task::watch(TaskRef& ref) {
+	assert(!closed);
+	ref.unwatch();
+	Cold& c = get_cold();
+	ref.task = this;
+	ref.next = c.refs;
+	if(c.refs)
+		c.refs->prev = &ref;
+	c.refs = &ref;
+}
+
+void Task::offload(WorkerPool& pool,Job* job) {
+	watch(*job);
+	pool.submit(job,scheduler.get_mailbox());
+}
+
+Task::Task(Scheduler& s,Task* parent): fd(-1), events(0), scheduler(s), out(NULL),
+	read_ahead_buffer(NULL), read_ahead_ofs(0), read_ahead_len(0), read_ahead_maxlen(0),
+	del_ok(false), closed(false), eoinput(false), sated(true), ready(false), congested(false), input_paused(false), tail_copy(false), accepted(false), idle(false), registered(0),
+	write_buffer(NULL), write_buffer_len(0), write_buffer_maxlen(0),
+	totalRead(0), totalWritten(0), tid(nexttid()), out_tail(NULL), out_length(0), queued(0), high_water(0), low_water(0),
+	half_close(NULL),
+	next_close(NULL), timeout(*this), cold(NULL) {
 	if(Log(LOG_CONN)) {
 		dump_context(stdout);
 		fprintf(stdout,"created\n");
 	}
 	// add to task tree
-	if(tree_parent) {
-		if(!tree_parent->tree_first_child)
-			tree_parent->tree_first_child = this;
+	if(parent) {
+		get_cold().tree_parent = parent;
+		Cold& p = parent->get_cold();
+		if(!p.tree_first_child)
+			p.tree_first_child = this;
 		else {
-			Task* sibling = tree_parent->tree_first_child;
-			while(sibling->tree_next_sibling)
-				sibling = sibling->tree_next_sibling;
-			sibling->tree_next_sibling = this;
+			Task* sibling = p.tree_first_child;
+			while(sibling->cold->tree_next_sibling)
+				sibling = sibling->cold->tree_next_sibling;
+			sibling->cold->tree_next_sibling = this;
 		}
 	}
 }
@@ -174,8 +590,19 @@ Task::~Task() {
 		link.prev->link.next = link.next;
 	if(link.next)
 		link.next->link.prev = link.prev;
-	free(read_ahead_buffer);
-	free(write_buffer);
+	if(ready)
+		std::replace(scheduler.ready.begin(),scheduler.ready.end(),this,(Task*)NULL);
+	if(read_ahead_buffer)
+		scheduler.buffers.release(read_ahead_buffer,read_ahead_maxlen);
+	if(write_buffer)
+		scheduler.buffers.release(write_buffer,write_buffer_maxlen);
+	delete cold;
+}
+
+Task::Cold& Task::get_cold() {
+	if(!cold)
+		cold = new Cold();
+	return *cold;
 }
 
 void Task::close_fd() {
@@ -190,27 +617,43 @@ void Task::close() {
 	if(closed)
 		return;
 	closed = true;
+	write_buffer_len = 0; // anything unflushed is discarded
+	queued = 0;
 	while(out) {
 		Out* tmp = out;
 		out = out->next;
 		tmp->release();
 	}
+	out_tail = NULL;
+	out_length = 0;
+	tail_copy = false;
+	set_idle(false);
+	if(accepted) {
+		accepted = false;
+		scheduler.connection_closed();
+	}
 	close_fd();
-	for(Task* child = tree_first_child; child; child = child->tree_next_sibling)
-		child->close(); // cascade close all children
+	if(cold)
+		for(Task* child = cold->tree_first_child; child; child = child->cold->tree_next_sibling)
+			child->close(); // cascade close all children
 	if(Log(LOG_CONN)) {
 		dump_context(stdout);
 		fprintf(stdout,"~ closed\n");
 		fflush(stdout);
 	}
-	if(Task* parent = tree_parent) {
-		while(parent->tree_parent)
-			parent = parent->tree_parent;
+	if(Task* parent = (cold? cold->tree_parent: NULL)) {
+		while(parent->cold->tree_parent)
+			parent = parent->cold->tree_parent;
 		parent->close(); // cascade from the very top too
 	}
+	while(cold && cold->refs) {
+		TaskRef* ref = cold->refs;
+		ref->unwatch();
+		ref->task_closed();
+	}
 	next_close = scheduler.close_list;
 	scheduler.close_list = this;
-	unlink_timeout();
+	timeout.cancel();
 	fd = -1;
 }
 
@@ -226,58 +669,83 @@ void Task::construct() {
 	do_construct();
 	// check and go
 	assert(0<fd && "expecting to be assigned an FD");
-	assert(event.events && "expecting to be scheduled");
-	set_nonblocking();
-	set_cloexec();
+	assert(events && "expecting to be scheduled");
+	if(fd != scheduler.prepared_fd) {
+		set_nonblocking();
+		set_cloexec();
+	} else {
+		accepted = true;
+		peer = scheduler.prepared_peer;
+		scheduler.load_stats.connections++;
+	}
 	self.detach();
-	if((EPOLLET & event.events) && (EPOLLIN & event.events))
-		run(EPOLLIN); // consume any already-received input; ### put on a run-list instead?
+	if((EPOLLET & events) && (EPOLLIN & events))
+		scheduler.make_ready(this); // consume any already-received input
 }
 
 void Task::setReadAheadBufferSize(uint16_t size) {
 	if(read_ahead_buffer) {
 		// tidy it up
 		read_ahead_len -= read_ahead_ofs;
-		read_ahead_ofs = 0;
 		memmove(read_ahead_buffer,read_ahead_buffer+read_ahead_ofs,read_ahead_len);
+		read_ahead_ofs = 0;
 		// somethig to do?
 		if(read_ahead_len > size)
 			ThrowInternalError("truncating the read-ahead buffer would lose %d buffered bytes",read_ahead_len);
 		// resize it
-		if(size) {
-			if(uint8_t* tmp = (uint8_t*)realloc(read_ahead_buffer,size)) {
-				read_ahead_buffer = tmp;
-				read_ahead_maxlen = size;
-			} //else log it failed?
-		} else {
-			free(read_ahead_buffer);
-			read_ahead_buffer = NULL;
+		uint8_t* tmp = NULL;
+		if(size && read_ahead_len) {
+			tmp = (uint8_t*)scheduler.buffers.alloc(size);
+			memcpy(tmp,read_ahead_buffer,read_ahead_len);
 		}
-	} else if(size) {
-		read_ahead_ofs = 0;
-		read_ahead_len = 0;
-		read_ahead_maxlen = size;
-		read_ahead_buffer = (uint8_t*)malloc(size);
+		scheduler.buffers.release(read_ahead_buffer,read_ahead_maxlen);
+		read_ahead_buffer = tmp;
 	}
+	read_ahead_maxlen = size;
+}
+
+void Task::setWriteWatermarks(uint32_t high,uint32_t low) {
+	if(high && (low >= high))
+		ThrowInternalError("low watermark %" PRIu32 " must be below high %" PRIu32,low,high);
+	high_water = high;
+	low_water = low;
 }
 
 void Task::setWriteBufferSize(uint16_t size) {
 	if(write_buffer) {
 		async_write_buffered();
-		if(size) {
-			if(uint8_t* tmp = (uint8_t*)realloc(write_buffer,size)) {
-				write_buffer = tmp;
-				write_buffer_maxlen = size;
-			} // else log it failed?
-		} else {
-			free(write_buffer);
-			write_buffer = NULL;
-		}
-	} else {
-		write_buffer_maxlen = size;
-		write_buffer_len = 0;
-		write_buffer = (uint8_t*)malloc(size);
-	}	
+		scheduler.buffers.release(write_buffer,write_buffer_maxlen);
+		write_buffer = NULL;
+	}
+	write_buffer_maxlen = size;
+}
+
+bool Task::alloc_read_ahead_buffer() {
+	if(!read_ahead_buffer && read_ahead_maxlen) {
+		assert(!read_ahead_ofs && !read_ahead_len);
+		read_ahead_buffer = (uint8_t*)scheduler.buffers.alloc(read_ahead_maxlen);
+	}
+	return read_ahead_buffer;
+}
+
+bool Task::alloc_write_buffer() {
+	if(!write_buffer && write_buffer_maxlen) {
+		assert(!write_buffer_len);
+		write_buffer = (uint8_t*)scheduler.buffers.alloc(write_buffer_maxlen);
+	}
+	return write_buffer;
+}
+
+void Task::release_idle_buffers() {
+	// an idle connection shouldn't be holding buffers it isn't using
+	if(read_ahead_buffer && !read_ahead_len) {
+		scheduler.buffers.release(read_ahead_buffer,read_ahead_maxlen);
+		read_ahead_buffer = NULL;
+	}
+	if(write_buffer && !write_buffer_len) {
+		scheduler.buffers.release(write_buffer,write_buffer_maxlen);
+		write_buffer = NULL;
+	}
 }
 
 static void DebugTaskTotals(Task& task,uint32_t prevWritten,uint32_t prevRead) {
@@ -313,24 +781,23 @@ void Task::run(uint32_t flags) {
 		}
 		if(~(EPOLLIN|EPOLLOUT)&flags)
 			ThrowInternalError("unexpected event");
-		if(!half_close && (EPOLLIN&flags)) {
+		if(!half_close && !input_paused && (EPOLLIN&flags)) {
 			try {
-				if(timeout.read.due)
-					timeout.read.due = (scheduler.get_now() + timeout.read.timeout);
+				if(timeout.read_due)
+					timeout.read_due = (scheduler.get_now() + millisecs_to_time64(timeout.read_millisecs));
 				try {
 					sated = false;
+					scheduler.slice_read_end = totalRead + scheduler.read_budget;
+					scheduler.slice_requests = scheduler.request_budget;
 					read();
-					if(!sated && (EPOLLET & event.events) && (EPOLLIN & event.events))
+					if(!sated && (EPOLLET & events) && (EPOLLIN & events))
 						ThrowInternalError("not sated");
 				} catch(HalfClose* hc) {
 					sated = true;
-					if(!out)
-						throw;
+					const char* reason = hc->msg;
 					hc->dump(this);
 					hc->release();
-					unschedule(EPOLLIN);
-					/*check(*/shutdown(fd,SHUT_RD)/*)*/;
-					half_close = hc->msg? hc->msg: "";
+					graceful_close(reason);
 				}
 				sated = true;
 			} catch(...) {
@@ -338,17 +805,26 @@ void Task::run(uint32_t flags) {
 				throw;
 			}
 		}
-		if(write_buffer_len)
-			async_write_buffered();
+		if(write_buffer_len && (IO_EOS == try_write_buffered())) {
+			close();
+			return;
+		}
 		if(EPOLLOUT&flags) {
-			if(timeout.write.due)
-				timeout.write.due = (scheduler.get_now() + timeout.write.timeout);
-			while(out) {
-				if(!out->async_write(this))
-					break;
-				Out* tmp = out;
-				out = out->next;
-				tmp->release();
+			if(timeout.write_due)
+				timeout.write_due = (scheduler.get_now() + millisecs_to_time64(timeout.write_millisecs));
+			if(IO_EOS == flush_out()) {
+				close();
+				return;
+			}
+			if(congested && (queued <= low_water)) {
+				congested = false;
+				if(input_paused && !half_close) {
+					// what arrived meanwhile won't be edge-triggered again
+					input_paused = false;
+					schedule(EPOLLIN);
+					scheduler.make_ready(this);
+				}
+				on_writable();
 			}
 			if(!out) {
 				unschedule(EPOLLOUT);
@@ -356,6 +832,7 @@ void Task::run(uint32_t flags) {
 					close();
 					return;
 				}
+				drained();
 			}
 		}
 	} catch(...) {
@@ -363,137 +840,102 @@ void Task::run(uint32_t flags) {
 		throw;
 	}
 	DebugTaskTotals(*this,prevWritten,prevRead);
-	if(timeout.read.due || timeout.write.due) {
-		// nothing out, so don't care about write timeout?
-		if(timeout.write.due && !out) {
-			timeout.due = timeout.read.due;
-			if(!timeout.due) // no read scheduled either
-				unlink_timeout();
-		} else {
-			timeout.due =
-				timeout.read.due?
-					timeout.write.due?
-						std::min(timeout.read.due,timeout.write.due):
-						timeout.read.due:
-					timeout.write.due;
-		}
-		sort_timeout();
+	if(closed)
+		return;
+	release_idle_buffers();
+	update_timeout();
+}
+
+void Task::yield() {
+	sated = true; // the read() that follows will carry on where this left off
+	scheduler.make_ready(this);
+}
+
+bool Task::next_request() {
+	if(!scheduler.request_budget)
+		return true;
+	if(scheduler.slice_requests) {
+		scheduler.slice_requests--;
+		return true;
 	}
+	yield();
+	return false;
+}
+
+void Task::defer_input() {
+	sated = true;
 }
 
 bool Task::Log(LogLevel level) {
-	if(logMask & level)
-		return (log & level);
+	if(cold && (cold->logMask & level))
+		return (cold->log & level);
 	return ::Log(level); // else defer to system defaults
 }
 
 void Task::SetLog(LogLevel level,bool enable) {
-	logMask |= level;
+	Cold& c = get_cold();
+	c.logMask |= level;
 	if(enable)
-		log |= level;
+		c.log |= level;
 	else
-		log &= ~level;
+		c.log &= ~level;
 }
 
-void Task::sort_timeout() {
-	// move to the right place in the queue, O(n)			
-	while(timeout.next && (timeout.next->timeout.due < timeout.due)) {
-		assert(this == timeout.next->timeout.prev);
-		if(this == scheduler.timeouts)
-			scheduler.timeouts = timeout.next;
-		if(timeout.prev) {
-			assert(this == timeout.prev->timeout.next);
-			timeout.prev->timeout.next = timeout.next;
-		}
-		timeout.next->timeout.prev = timeout.prev;
-		timeout.prev = timeout.next;
-		timeout.next = timeout.prev->timeout.next;
-		timeout.prev->timeout.next = this;
-		if(timeout.next)
-			timeout.next->timeout.prev = this;
-	}
-	while(timeout.prev && (timeout.prev->timeout.due > timeout.due)) {
-		assert(this == timeout.prev->timeout.next);
-		if(timeout.prev == scheduler.timeouts)
-			scheduler.timeouts = this;
-		if(timeout.next) {
-			assert(this == timeout.next->timeout.prev);
-			timeout.next->timeout.prev = timeout.prev;
-		}
-		timeout.prev->timeout.next = timeout.next;
-		timeout.next = timeout.prev;
-		timeout.prev = timeout.next->timeout.prev;
-		timeout.next->timeout.prev = this;
-		if(timeout.prev)
-			timeout.prev->timeout.next = this;
-	}
-}
-
-void Task::unlink_timeout() {
-	timeout.due = 0;
-	if(this == scheduler.timeouts) {
-		assert(!timeout.prev);
-		scheduler.timeouts = timeout.next;
-	}
-	if(timeout.prev) {
-		assert(this == timeout.prev->timeout.next);
-		timeout.prev->timeout.next = timeout.next;
-	}
-	if(timeout.next) {
-		assert(this == timeout.next->timeout.prev);
-		timeout.next->timeout.prev = timeout.prev;
-	}
-	timeout.next = timeout.prev = NULL;
+void Task::update_timeout() {
+	/* a timer that is already due sooner is left alone; when it fires it notices and catches up,
+	   so re-arming on every event doesn't have to touch the heap */
+	const time64_t due = timeout.get_due();
+	if(!due)
+		timeout.cancel();
+	else if(!timeout.is_pending() || (due < scheduler.get_timer_due(&timeout)))
+		scheduler.set_timer(&timeout,due);
 }
 
 void Task::set_read_timeout(uint32_t millisecs) { // 0 to clear
-	set_timeout(timeout.read,timeout.write,millisecs);
+	if(!scheduler.timeouts_enabled)
+		return;
+	timeout.read_millisecs = millisecs;
+	timeout.read_due = (millisecs? scheduler.get_now() + millisecs_to_time64(millisecs): 0);
+	update_timeout();
 }
 
 void Task::set_write_timeout(uint32_t millisecs) {
-	set_timeout(timeout.write,timeout.read,millisecs);
+	if(!scheduler.timeouts_enabled)
+		return;
+	timeout.write_millisecs = millisecs;
+	timeout.write_due = (millisecs? scheduler.get_now() + millisecs_to_time64(millisecs): 0);
+	update_timeout();
 }
 
-void Task::set_timeout(Timeout::Data& to,Timeout::Data& other,uint32_t millisecs) {
+void Task::set_deadline(const time64_t& due) {
 	if(!scheduler.timeouts_enabled)
 		return;
-	const bool was_scheduled = to.due;
-	to.timeout = millisecs_to_time64(millisecs);
-	to.due = (scheduler.get_now() + to.timeout);
-	if(!to.due && was_scheduled) {
-		if(other.due)
-			timeout.due = other.due;
-		else {
-			timeout.due = 0;
-			if(this == scheduler.timeouts) {
-				assert(!timeout.prev);
-				scheduler.timeouts = timeout.next;
-			}
-			if(timeout.prev) {
-				assert(this == timeout.prev->timeout.next);
-				timeout.prev->timeout.next = timeout.next;
-			}
-			if(timeout.next) {
-				assert(this == timeout.next->timeout.prev);
-				timeout.next->timeout.prev = timeout.prev;
-			}
-			timeout.next = timeout.prev = NULL;
-		}
-	} else if(to.due) {
-		if(other.due)
-			timeout.due = std::min(other.due,to.due);
-		else {
-			timeout.due = to.due;
-			if(!was_scheduled) {
-				assert(!timeout.prev && !timeout.next);
-				timeout.next = scheduler.timeouts;
-				if(timeout.next) {
-					assert(!timeout.next->timeout.prev);
-					timeout.next->timeout.prev = this;
-				}
-				scheduler.timeouts = this;
-			}
-		}
+	timeout.deadline = due;
+	update_timeout();
+}
+
+void Task::set_idle(bool i) {
+	if(i == idle)
+		return;
+	idle = i;
+	if(idle) { // onto the tail
+		idle_link.prev = scheduler.idle_tail;
+		idle_link.next = NULL;
+		if(scheduler.idle_tail)
+			scheduler.idle_tail->idle_link.next = this;
+		else
+			scheduler.idle_head = this;
+		scheduler.idle_tail = this;
+	} else {
+		if(idle_link.prev)
+			idle_link.prev->idle_link.next = idle_link.next;
+		else
+			scheduler.idle_head = idle_link.next;
+		if(idle_link.next)
+			idle_link.next->idle_link.prev = idle_link.prev;
+		else
+			scheduler.idle_tail = idle_link.prev;
+		idle_link.prev = idle_link.next = NULL;
 	}
 }
 
@@ -502,14 +944,30 @@ void Task::handle_timeout(const time64_t& now) {
 	if(Log(LOG_CONN)) {
 		dump_context(stdout);
 		printf("timeout");
-		if(timeout.read.due && (now >= timeout.read.due))
-			printf(" read (%"PRIu32")",time64_to_millisecs(timeout.read.timeout));
-		if(timeout.write.due && (now >= timeout.write.due))
-			printf(" write (%"PRIu32")",time64_to_millisecs(timeout.write.timeout));
+		if(timeout.read_due && (now >= timeout.read_due))
+			printf(" read (%"PRIu32")",timeout.read_millisecs);
+		if(timeout.write_due && (now >= timeout.write_due))
+			printf(" write (%"PRIu32")",timeout.write_millisecs);
+		if(timeout.deadline && (now >= timeout.deadline))
+			printf(" deadline");
 		putchar('\n');
 	}
 }
 
+void Task::graceful_close(const char* reason) {
+	if(closed)
+		return;
+	if((IO_EOS == try_write_buffered()) || !out) {
+		close();
+		return;
+	}
+	if(!half_close) {
+		unschedule(EPOLLIN);
+		/*check(*/shutdown(fd,SHUT_RD)/*)*/;
+		half_close = reason? reason: "";
+	}
+}
+
 bool Task::is_closed() const {
 	return (closed || half_close);
 }
@@ -530,7 +988,16 @@ void Task::set_nodelay(bool enabled) {
 
 void Task::set_nodelay(int fd,bool enabled) {
 	int flag = enabled;
-	check(setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,(char*)&flag,sizeof(int)));
+	if(setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,(char*)&flag,sizeof(int)) && (EOPNOTSUPP != errno)) // e.g. unix sockets
+		fail("set_nodelay");
+}
+
+bool Task::set_busy_poll(FD fd,uint32_t microsecs,bool prefer) {
+	int value = microsecs;
+	if(setsockopt(fd,SOL_SOCKET,SO_BUSY_POLL,&value,sizeof(value)))
+		return false; // raising it above net.core.busy_read needs CAP_NET_ADMIN
+	value = 1;
+	return !prefer || !setsockopt(fd,SOL_SOCKET,SO_PREFER_BUSY_POLL,&value,sizeof(value));
 }
 
 void Task::set_cloexec() {
@@ -538,28 +1005,49 @@ void Task::set_cloexec() {
 }
 
 void Task::set_cloexec(FD fd) {
-	int old_flags = fcntl(fd,F_GETFL,0);
+	int old_flags = fcntl(fd,F_GETFD,0); // FD_CLOEXEC is a descriptor flag, not a file status flag
 	check(old_flags);
-	check(fcntl(fd,F_SETFL,old_flags|FD_CLOEXEC));
+	check(fcntl(fd,F_SETFD,old_flags|FD_CLOEXEC));
 }
 
 void Task::schedule(uint32_t flags) {
-	const bool added = event.events;
-	event.events |= flags;
-	check(epoll_ctl(scheduler.getfd(),added?EPOLL_CTL_MOD:EPOLL_CTL_ADD,fd,&event));
+	events |= flags;
+	update_interest();
 }
 
 void Task::unschedule(uint32_t flags) {
-	if(event.events) {
-		event.events &= ~flags;
-		const bool remove = !(~EPOLLET & event.events);
-		check(epoll_ctl(scheduler.getfd(),remove?EPOLL_CTL_DEL:EPOLL_CTL_MOD,fd,&event));
-		if(remove)
-			event.events = 0;
+	if(events) {
+		events &= ~flags;
+		if(!(~EPOLLET & events))
+			events = 0; // nothing to wait for
+		update_interest();
 	}
 }
 
-bool Task::async_read(void* ptr,ssize_t bytes,ssize_t& read) {
+void Task::update_interest() {
+	/* edge-triggered tasks stay registered for what they have ever waited for, and the Scheduler
+	   filters out what they no longer want; an edge costs nothing until it happens, whereas
+	   changing the interest set is a syscall every time the output queue starts or drains */
+	uint8_t interest = events & (EPOLLIN|EPOLLOUT);
+	if(EPOLLET & events)
+		interest |= registered;
+	if(interest == registered)
+		return;
+	epoll_event event;
+	event.events = interest | (events & EPOLLET);
+	event.data.ptr = this;
+	const int op = !interest? EPOLL_CTL_DEL: registered? EPOLL_CTL_MOD: EPOLL_CTL_ADD;
+	check(epoll_ctl(scheduler.getfd(),op,fd,&event));
+	registered = interest;
+	Scheduler::PollStats& stats = scheduler.poll_stats;
+	switch(op) {
+	case EPOLL_CTL_ADD: stats.ctl_add++; break;
+	case EPOLL_CTL_MOD: stats.ctl_mod++; break;
+	default: stats.ctl_del++;
+	}
+}
+
+IoStatus Task::try_read(void* ptr,ssize_t bytes,ssize_t& read) {
 	if(is_closed())
 		ThrowInternalError("cannot read when closed");
 	if(sated)
@@ -576,14 +1064,23 @@ bool Task::async_read(void* ptr,ssize_t bytes,ssize_t& read) {
 				read_ahead_ofs = read_ahead_len = 0;
 			read += buffered;
 		} else {
-			const bool buffer = (read_ahead_buffer && (ptr != read_ahead_buffer) && ((bytes-read) < read_ahead_maxlen));
+			if(scheduler.read_budget && (0 <= (int32_t)(totalRead - scheduler.slice_read_end))) {
+				yield(); // had its share; carry on next time round
+				return IO_AGAIN;
+			}
+			if(input_paused) { // until the peer catches up with what we've written
+				sated = true;
+				return IO_AGAIN;
+			}
+			const bool buffer = (read_ahead_maxlen && (ptr != read_ahead_buffer) && ((bytes-read) < read_ahead_maxlen) &&
+				alloc_read_ahead_buffer());
 			const ssize_t read_ret = ::read(fd,
 				buffer? read_ahead_buffer+read_ahead_len: c+read,
 				buffer? read_ahead_maxlen-read_ahead_len: bytes-read);
 			if(0>read_ret) {
 				if(EWOULDBLOCK==errno) {
 					sated = true;
-					return false;
+					return IO_AGAIN;
 				}
 				fail("async_read()");
 			} else if(!read_ret) {
@@ -591,9 +1088,9 @@ bool Task::async_read(void* ptr,ssize_t bytes,ssize_t& read) {
 				sated = true;
 				if(RUNNING_ON_VALGRIND) {
 					dump_context(stdout);
-					printf("async_read(ptr,%d,%zu) end of input stream\n",(int)bytes,read);
+					printf("try_read(ptr,%d,%zu) end of input stream\n",(int)bytes,read);
 				}
-				ThrowEndOfStreamError();
+				return IO_EOS;
 			} else {
 				totalRead += read_ret;
 				if(buffer)
@@ -604,93 +1101,190 @@ bool Task::async_read(void* ptr,ssize_t bytes,ssize_t& read) {
 		}
 	}
 	assert(read == bytes);
-	return true;
+	return IO_OK;
 }
 
-uint16_t Task::async_read_buffered(uint8_t*& ptr,uint16_t max) {
-	if(!read_ahead_buffer)
+IoStatus Task::try_splice_in(FD pipe,size_t max,size_t& spliced) {
+	if(is_closed())
+		ThrowInternalError("cannot read when closed");
+	if(sated)
+		ThrowInternalError("shouldn\'t read when sated");
+	if(read_ahead_ofs < read_ahead_len)
+		ThrowInternalError("cannot splice past what is read ahead");
+	spliced = 0;
+	assert(0<max);
+	if(scheduler.read_budget && (0 <= (int32_t)(totalRead - scheduler.slice_read_end))) {
+		yield();
+		return IO_AGAIN;
+	}
+	if(input_paused) {
+		sated = true;
+		return IO_AGAIN;
+	}
+	const ssize_t ret = splice(fd,NULL,pipe,NULL,max,SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+	if(0>ret) {
+		if(EAGAIN==errno) {
+			sated = true;
+			return IO_AGAIN;
+		}
+		fail("splice()");
+	} else if(!ret) {
+		eoinput = true;
+		sated = true;
+		return IO_EOS;
+	}
+	totalRead += ret;
+	spliced = ret;
+	return IO_OK;
+}
+
+bool Task::async_read(void* ptr,ssize_t bytes,ssize_t& read) {
+	const IoStatus status = try_read(ptr,bytes,read);
+	if(IO_EOS == status)
+		ThrowEndOfStreamError();
+	return (IO_OK == status);
+}
+
+IoStatus Task::try_read_buffered(uint8_t*& ptr,uint16_t& len,uint16_t max) {
+	if(!alloc_read_ahead_buffer())
 		ThrowInternalError("cannot read from buffer");
+	len = 0;
 	if(read_ahead_ofs == read_ahead_len) {
 		assert(!read_ahead_len);
 		if(sated)
-			return 0;
+			return (eoinput? IO_EOS: IO_AGAIN);
 		ssize_t read;
-		async_read(read_ahead_buffer,read_ahead_maxlen,read);
+		const IoStatus status = try_read(read_ahead_buffer,read_ahead_maxlen,read);
 		read_ahead_len += read;
+		if(!read) // any data is returned before the status is
+			return status;
 	}
-	if(read_ahead_ofs < read_ahead_len) {
-		const uint16_t len = std::min<uint16_t>(max,read_ahead_len-read_ahead_ofs);
-		ptr = read_ahead_buffer + read_ahead_ofs;
-		read_ahead_ofs += len;
-		if(read_ahead_ofs == read_ahead_len)
-			read_ahead_ofs = read_ahead_len = 0;
-		return len;
-	}
-	return 0;
+	assert(read_ahead_ofs < read_ahead_len);
+	len = std::min<uint16_t>(max,read_ahead_len-read_ahead_ofs);
+	ptr = read_ahead_buffer + read_ahead_ofs;
+	read_ahead_ofs += len;
+	if(read_ahead_ofs == read_ahead_len)
+		read_ahead_ofs = read_ahead_len = 0;
+	return IO_OK;
 }
 
-bool Task::async_read(ResizeableBuffer& in,ssize_t& read,ssize_t max) {
+uint16_t Task::async_read_buffered(uint8_t*& ptr,uint16_t max) {
+	uint16_t len;
+	if(IO_EOS == try_read_buffered(ptr,len,max))
+		ThrowEndOfStreamError();
+	return len;
+}
+
+IoStatus Task::try_read(ResizeableBuffer& in,ssize_t& read,ssize_t max) {
 	read = 0;
 	for(;;) {
 		const ssize_t remaining = max? max-read: 512; 
 		if(!remaining)
-			return false;
+			return IO_OK;
 		in.ensure_capacity(remaining);
 		ssize_t bytes;
-		const bool sated = !async_read(in.data(in.length()),remaining,bytes);
+		const IoStatus status = try_read(in.data(in.length()),remaining,bytes);
 		read += bytes;
 		in.set_length(in.length() + bytes);
-		assert(sated == (bytes < remaining));
-		if(sated)
-			return true;
+		assert((IO_OK == status) == (bytes == remaining));
+		if(IO_OK != status)
+			return status;
 	}
 }
 
-bool Task::async_read_str(char* s,size_t& len,size_t max) {
+bool Task::async_read(ResizeableBuffer& in,ssize_t& read,ssize_t max) {
+	const IoStatus status = try_read(in,read,max);
+	if(IO_EOS == status)
+		ThrowEndOfStreamError();
+	return (IO_AGAIN == status); // sated
+}
+
+IoStatus Task::try_read_str(char* s,size_t& len,size_t max) {
 	while(len < max) {
 		if(read_ahead_buffer && read_ahead_len) {
 			s[len] = (char)read_ahead_buffer[read_ahead_ofs];
 			if(++read_ahead_ofs == read_ahead_len)
 				read_ahead_ofs = read_ahead_len = 0;
 		} else {
+			if(sated) { // e.g. a body read ahead up to EAGAIN and the next request follows
+				s[len] = 0;
+				return (eoinput? IO_EOS: IO_AGAIN);
+			}
 			ssize_t read;
-			if(!async_read(s+len,1,read)) {
+			const IoStatus status = try_read(s+len,1,read);
+			if(IO_OK != status) {
 				s[len] = 0;
-				return false;
+				return status;
 			}
 		}
-		if(!s[len] || ('\n'==s[len]))
-			break;
+		if(!s[len] || ('\n'==s[len])) {
+			s[len+1] = 0;
+			return IO_OK;
+		}
 		len++;
 	}
-	s[len+1] = 0;
-	return true;
+	s[len] = 0; // full; don't terminate past the end
+	return IO_OK;
+}
+
+bool Task::async_read_str(char* s,size_t& len,size_t max) {
+	const IoStatus status = try_read_str(s,len,max);
+	if(IO_EOS == status)
+		ThrowEndOfStreamError();
+	return (IO_OK == status);
+}
+
+IoStatus Task::flush_out() {
+	while(out) {
+		// as much of the queue as fits in one writev
+		iovec iov[Out::MAX_IOV];
+		int iovcnt = 0;
+		for(Out* o = out; o && (iovcnt < Out::MAX_IOV); o = o->next)
+			iovcnt += o->get_iov(iov+iovcnt,Out::MAX_IOV-iovcnt);
+		size_t written;
+		const IoStatus status = do_async_writev(iov,iovcnt,written);
+		queued -= written;
+		while(out && (written >= (out->len-out->ofs))) {
+			written -= (out->len-out->ofs);
+			Out* tmp = out;
+			out = out->next;
+			tmp->release();
+			out_length--;
+		}
+		if(out)
+			out->ofs += written;
+		if(IO_OK != status)
+			return status;
+	}
+	out_tail = NULL;
+	tail_copy = false;
+	return IO_OK;
 }
 
 void Task::async_write_buffered() {
-	if(!write_buffer || !write_buffer_len) return;
+	if(IO_EOS == try_write_buffered())
+		ThrowGracefulClose("end of output stream");
+}
+
+IoStatus Task::try_write_buffered() {
+	if(!write_buffer_len) return IO_OK;
 	if(!out) {
 		OutConst o(write_buffer,write_buffer_len);
-		if(!o.async_write(this)) {
-			uint8_t* buf = new uint8_t[write_buffer_len-o.ofs];
-			size_t len = write_buffer_len-o.ofs;
-			memcpy(buf,write_buffer+o.ofs,len);
-			out = new OutDeleteArray<uint8_t>(buf,len);
-			schedule(EPOLLOUT);
-		}
-	} else {
-		Out* tail = out;
-		while(tail->next)
-			tail = tail->next;
-		uint8_t* buf = new uint8_t[write_buffer_len];
-		memcpy(buf,write_buffer,write_buffer_len);
-		tail->next = new OutDeleteArray<uint8_t>(buf,write_buffer_len);
-	}
+		const IoStatus status = o.async_write(this);
+		if(IO_EOS == status) {
+			write_buffer_len = 0;
+			return IO_EOS;
+		} else if(IO_AGAIN == status)
+			enqueue_copy(write_buffer+o.ofs,write_buffer_len-o.ofs);
+	} else
+		enqueue_copy(write_buffer,write_buffer_len);
+	const IoStatus status = (out? IO_AGAIN: IO_OK);
 	write_buffer_len = 0;
+	return status;
 }
 
 void Task::async_write(const void* ptr,size_t len) {
-	if(write_buffer) {
+	if(alloc_write_buffer()) {
 		if(len <= (write_buffer_maxlen-write_buffer_len)) {
 			memcpy(write_buffer+write_buffer_len,ptr,len);
 			write_buffer_len += len;
@@ -700,82 +1294,139 @@ void Task::async_write(const void* ptr,size_t len) {
 	}
 	if(!out) {
 		OutConst o(ptr,len);
-		if(!o.async_write(this)) {
-			out = new OutConst(o);
-			schedule(EPOLLOUT);
-		}
-	} else {
-		Out* tail = out;
-		while(tail->next)
-			tail = tail->next;
-		tail->next = new OutConst(ptr,len);
-	}
+		const IoStatus status = o.async_write(this);
+		if(IO_EOS == status)
+			ThrowGracefulClose("end of output stream");
+		if(IO_AGAIN == status)
+			enqueue(new OutConst(o));
+	} else if(tail_copy && (len <= static_cast<OutCopy*>(out_tail)->spare()))
+		enqueue_copy(ptr,len); // cheaper than a node of its own
+	else
+		enqueue(new OutConst(ptr,len));
 }
 
 void Task::async_write_cpy(const void* ptr,size_t len) {
+	if(IO_EOS == try_write_cpy(ptr,len))
+		ThrowGracefulClose("end of output stream");
+}
+
+IoStatus Task::try_write_cpy(const void* ptr,size_t len) {
 	/* if ptr cannot be completely written synchronously, a copy of the unsent part is made */
-	if(write_buffer) {
+	if(alloc_write_buffer()) {
 		if(len <= (write_buffer_maxlen-write_buffer_len)) {
 			memcpy(write_buffer+write_buffer_len,ptr,len);
 			write_buffer_len += len;
-			return;
+			return IO_OK;
 		}
-		async_write_buffered();
+		if(IO_EOS == try_write_buffered())
+			return IO_EOS;
 	}
 	if(!out) {
 		OutConst o(ptr,len);
-		if(!o.async_write(this)) {
-			const size_t remaining = (len-o.ofs);
-			void* buf = malloc(remaining);
-			if(!buf)
-				ThrowInternalError("out of memory");
-			memcpy(buf,reinterpret_cast<const uint8_t*>(ptr)+o.ofs,remaining);
-			try {
-				out = new OutFree(buf,remaining);
-			} catch(...) {
-				free(buf);
-				throw;
-			}
-			schedule(EPOLLOUT);
+		const IoStatus status = o.async_write(this);
+		if(IO_OK != status) {
+			if(IO_EOS == status)
+				return IO_EOS;
+			enqueue_copy(reinterpret_cast<const uint8_t*>(ptr)+o.ofs,len-o.ofs);
+			return IO_AGAIN;
 		}
 	} else {
-		Out* tail = out;
-		while(tail->next)
-			tail = tail->next;
-		void* buf = malloc(len);
-		if(!buf)
-			ThrowInternalError("out of memory");
-		memcpy(buf,ptr,len);
-		try {
-			tail->next = new OutFree(buf,len);
-		} catch(...) {
-			free(buf);
-			throw;
-		}
+		enqueue_copy(ptr,len);
+		return IO_AGAIN;
 	}
+	return IO_OK;
 }
 
 void Task::async_write(Out* o) {
 	Cleanup<Out,CleanupRelease> c(o);
-	if(write_buffer) {
+	if(alloc_write_buffer()) {
 		ssize_t len = (o->len-o->ofs);
-		if(len <= (write_buffer_maxlen-write_buffer_len)) {
+		if(o->ptr && (len <= (write_buffer_maxlen-write_buffer_len))) {
 			memcpy(write_buffer+write_buffer_len,(char*)o->ptr+o->ofs,len);
 			write_buffer_len += len;
 			return;
 		}
+		if(write_buffer_len && !out) {
+			// what is buffered (typically headers) and o go in one writev
+			iovec iov[Out::MAX_IOV];
+			iov[0].iov_base = write_buffer;
+			iov[0].iov_len = write_buffer_len;
+			size_t written;
+			IoStatus status = do_async_writev(iov,1+o->get_iov(iov+1,Out::MAX_IOV-1),written);
+			if(IO_EOS == status) {
+				write_buffer_len = 0;
+				ThrowGracefulClose("end of output stream");
+			}
+			if(written < write_buffer_len) {
+				enqueue_copy(write_buffer+written,write_buffer_len-written);
+				written = 0;
+			} else
+				written -= write_buffer_len;
+			write_buffer_len = 0;
+			o->ofs += written;
+			if(IO_OK == status)
+				status = c->async_write(this); // whatever didn't fit in iov
+			if(IO_EOS == status)
+				ThrowGracefulClose("end of output stream");
+			if(IO_AGAIN == status)
+				enqueue(c.detach());
+			return;
+		}
 		async_write_buffered();
 	}
 	if(!out) {
-		if(!c->async_write(this)) {
-			out = c.detach();
-			schedule(EPOLLOUT);
+		const IoStatus status = c->async_write(this);
+		if(IO_EOS == status)
+			ThrowGracefulClose("end of output stream");
+		if(IO_AGAIN == status)
+			enqueue(c.detach());
+	} else
+		enqueue(c.detach());
+}
+
+char* Task::reserve_write(size_t len) {
+	if(!alloc_write_buffer() || (len > write_buffer_maxlen))
+		return NULL;
+	if(len > (size_t)(write_buffer_maxlen-write_buffer_len))
+		async_write_buffered();
+	return reinterpret_cast<char*>(write_buffer+write_buffer_len);
+}
+
+void Task::enqueue(Out* o) {
+	if(!out) {
+		out = o;
+		schedule(EPOLLOUT);
+	} else
+		out_tail->next = o;
+	out_tail = o;
+	tail_copy = false;
+	Scheduler::OutStats& stats = scheduler.out_stats;
+	stats.nodes++;
+	if(++out_length > stats.max_length)
+		stats.max_length = out_length;
+	count_queued(o->len - o->ofs);
+}
+
+void Task::enqueue_copy(const void* ptr,size_t len) {
+	if(tail_copy && (len <= static_cast<OutCopy*>(out_tail)->spare())) {
+		static_cast<OutCopy*>(out_tail)->append(ptr,len);
+		scheduler.out_stats.coalesced++;
+		count_queued(len);
+		return;
+	}
+	enqueue(OutCopy::create(scheduler.buffers,ptr,len));
+	tail_copy = true;
+}
+
+void Task::count_queued(size_t len) {
+	scheduler.out_stats.queued++;
+	queued += len;
+	if(high_water && !congested && (queued > high_water)) {
+		congested = true;
+		if(EPOLLIN & events) {
+			input_paused = true;
+			unschedule(EPOLLIN);
 		}
-	} else {
-		Out* tail = out;
-		while(tail->next)
-			tail = tail->next;
-		tail->next = c.detach();
 	}
 }
 
@@ -791,11 +1442,27 @@ void Task::async_printf(const char* fmt,...) {
 }
 
 void Task::async_vprintf(const char* fmt,va_list ap) {
+	if(alloc_write_buffer() && (write_buffer_len < write_buffer_maxlen)) {
+		// straight into the write buffer if it fits
+		va_list copy;
+		va_copy(copy,ap);
+		const size_t spare = (write_buffer_maxlen-write_buffer_len);
+		const int len = vsnprintf(reinterpret_cast<char*>(write_buffer+write_buffer_len),spare,fmt,copy);
+		va_end(copy);
+		check(len);
+		if((size_t)len < spare) {
+			write_buffer_len += len;
+			return;
+		}
+	}
 	char buf[1024];
-	int len = vsnprintf(buf,sizeof(buf),fmt,ap);
+	va_list copy;
+	va_copy(copy,ap);
+	int len = vsnprintf(buf,sizeof(buf),fmt,copy);
+	va_end(copy);
 	if(!len) return;
 	check(len);
-	if(len == sizeof(buf)) { // overflowed?
+	if(len >= (int)sizeof(buf)) { // overflowed?
 		char* s;
 		len = vasprintf(&s,fmt,ap);
 		check(len);
@@ -804,7 +1471,7 @@ void Task::async_vprintf(const char* fmt,va_list ap) {
 		async_write_cpy(buf,len);
 }
 
-bool Task::do_async_write(const void* ptr,size_t len,size_t& written) {
+IoStatus Task::do_async_write(const void* ptr,size_t len,size_t& written) {
 	if(closed) // ignore half_closed, so don't use is_closed()
 		ThrowInternalError("cannot write when closed");
 	written = 0;
@@ -813,22 +1480,58 @@ bool Task::do_async_write(const void* ptr,size_t len,size_t& written) {
 		const int write_ret = ::write(fd,c+written,len-written);
 		if(0>write_ret) {
 			if(EWOULDBLOCK==errno)
-				return false;
+				return IO_AGAIN;
+			else if((EPIPE==errno)||(ECONNRESET==errno))
+				return IO_EOS;
 			else if(EINTR!=errno)
 				fail("async_write()");
 		} else if(!write_ret)
-			ThrowGracefulClose("end of output stream");
+			return IO_EOS;
 		else {
 			written += write_ret;
 			totalWritten += write_ret;
 		}
 	}
 	assert(written == len);
-	return true;
+	return IO_OK;
+}
+
+IoStatus Task::do_async_writev(iovec* iov,int iovcnt,size_t& written) {
+	// iov is advanced past what is written
+	if(closed)
+		ThrowInternalError("cannot write when closed");
+	written = 0;
+	while(iovcnt) {
+		const ssize_t write_ret = ::writev(fd,iov,iovcnt);
+		if(0>write_ret) {
+			if(EWOULDBLOCK==errno)
+				return IO_AGAIN;
+			else if((EPIPE==errno)||(ECONNRESET==errno))
+				return IO_EOS;
+			else if(EINTR!=errno)
+				fail("async_writev()");
+		} else if(!write_ret)
+			return IO_EOS;
+		else {
+			written += write_ret;
+			totalWritten += write_ret;
+			size_t consumed = write_ret;
+			while(iovcnt && (consumed >= iov->iov_len)) {
+				consumed -= iov->iov_len;
+				iov++;
+				iovcnt--;
+			}
+			if(consumed) {
+				iov->iov_base = reinterpret_cast<char*>(iov->iov_base)+consumed;
+				iov->iov_len -= consumed;
+			}
+		}
+	}
+	return IO_OK;
 }
 
 void Task::dump_context(FILE* out) const {
-	fprintf(out,"%"PRIxPTR" [%04"PRIu64,(intptr_t)this,tid);
+	fprintf(out,"%"PRIxPTR" [%04"PRIu32,(intptr_t)this,tid);
 	if(-1 == fd)
 		fprintf(out,":closed");
 	else if(0 > fd)
@@ -836,8 +1539,8 @@ void Task::dump_context(FILE* out) const {
 	fprintf(out,"] ");
 }
 
-uint64_t Task::nexttid() {
-	static uint64_t tids = 0;
+uint32_t Task::nexttid() {
+	static std::atomic<uint32_t> tids(0); // schedulers may run on several threads
 	return ++tids;
 }
 
@@ -889,6 +1592,60 @@ void Task::popen(FD fd[3],const char *const cmd[]) {
 	}
 }
 
+BufferPool::BufferPool(): in_use(0) {
+	memset(classes,0,sizeof(classes));
+}
+
+BufferPool::~BufferPool() {
+	for(int i=0; i<MAX_CLASSES; i++)
+		while(void* buf = classes[i].free) {
+			classes[i].free = *reinterpret_cast<void**>(buf);
+			free(buf);
+		}
+}
+
+BufferPool::Class* BufferPool::get_class(size_t size) {
+	for(int i=0; i<MAX_CLASSES; i++) {
+		if(classes[i].size == size)
+			return classes+i;
+		if(!classes[i].size) {
+			classes[i].size = size;
+			return classes+i;
+		}
+	}
+	return NULL; // too many different sizes; just use malloc
+}
+
+void* BufferPool::alloc(size_t size) {
+	assert(size >= sizeof(void*));
+	Class* c = get_class(size);
+	in_use += size;
+	if(c && c->free) {
+		void* buf = c->free;
+		c->free = *reinterpret_cast<void**>(buf);
+		c->count--;
+		return buf;
+	}
+	void* buf = malloc(size);
+	if(!buf) {
+		in_use -= size;
+		ThrowInternalError("out of memory");
+	}
+	return buf;
+}
+
+void BufferPool::release(void* buf,size_t size) {
+	in_use -= size;
+	Class* c = get_class(size);
+	if(!c || (c->count >= MAX_FREE)) {
+		free(buf);
+		return;
+	}
+	*reinterpret_cast<void**>(buf) = c->free;
+	c->free = buf;
+	c->count++;
+}
+
 bool starts_with(const char* s,const char* prefix) {
 	while(*prefix)
 		if(*prefix++ != *s++)
@@ -8,6 +8,8 @@
 #include "time.hpp"
 #include "callback_list.hpp"
 #include "out.hpp"
+#include "format.hpp"
+#include "address.hpp"
 
 #include <unistd.h>
 #include <sys/epoll.h>
@@ -15,23 +17,36 @@
 #include <algorithm>
 #include "valgrind/memcheck.h"
 
-class Readable {
+/* Readable and Writeable are compile-time interfaces; rather than adding a vptr to every Task
+   and an indirect call to every read and write, the implementation I is expected to provide:
+	IoStatus try_read(void* ptr,ssize_t bytes,ssize_t& read);
+	IoStatus try_read(ResizeableBuffer& in,ssize_t& read,ssize_t max = 0);
+	IoStatus try_read_str(char* s,size_t& len,size_t max);
+	bool async_read(void* ptr,ssize_t bytes,ssize_t& read);
+	bool async_read(ResizeableBuffer& in,ssize_t& read,ssize_t max = 0);
+	bool async_read_str(char* s,size_t& len,size_t max);
+   and:
+	IoStatus try_write_cpy(const void* ptr,size_t len); // IO_AGAIN if some is queued
+	void async_write(const void* ptr,size_t len);
+	void async_write(Out* out); // releases when sent
+	void async_write(const char* s);
+	void async_write_cpy(const void* ptr,size_t len);
+*/
+
+template<class I> class Readable {
 public:
-	virtual bool async_read(void* ptr,ssize_t bytes,ssize_t& read) = 0;
-	virtual bool async_read(ResizeableBuffer& in,ssize_t& read,ssize_t max = 0) = 0;
-	virtual bool async_read_str(char* s,size_t& len,size_t max) = 0;
-	bool async_read_str(char* s,size_t max) { size_t len = strlen(s); return async_read_str(s,len,max); }
+	bool async_read_str(char* s,size_t max) { size_t len = strlen(s); return self().async_read_str(s,len,max); }
+private:
+	I& self() { return static_cast<I&>(*this); }
 };
 
-class Writeable {
+template<class I> class Writeable {
 public:
-	virtual void async_write(const void* ptr,size_t len) = 0;
-	virtual void async_write(Out* out) /* releases when sent */ = 0;
-	virtual void async_write(const char* s) = 0;
-	virtual void async_write_cpy(const void* ptr,size_t len) = 0;
 	template<typename T> void async_write_t(const T& t,size_t bytes) {
-		async_write_cpy(&t,bytes);
+		self().async_write_cpy(&t,bytes);
 	}
+private:
+	I& self() { return static_cast<I&>(*this); }
 };
 
 bool starts_with(const char* s,const char* prefix);
@@ -55,20 +70,78 @@ public:
 		return (suffix_len>len? false: !memcmp(suffix,tail,suffix_len));
 	}
 	size_t size() const { return len; }
+	void chomp() { if(len && ('\r' == bufz[len-1])) len--; bufz[len] = 0; } // drops the line ending
 private:
 	char bufz[MAX+1];
 	size_t len;
 };
 
 class Scheduler;
+class Task;
+class Mailbox;
+class WorkerPool;
+class Job;
+class RateLimiter;
 typedef int FD;
 
-class Task: virtual public ErrorContext, virtual public Closeable, virtual protected Readable, virtual protected Writeable {
+class TaskRef {
+	/* a weak reference to a Task, cleared when the task closes; only for use on the task's
+	   scheduler thread */
+public:
+	TaskRef(): task(NULL), prev(NULL), next(NULL) {}
+	virtual ~TaskRef() { unwatch(); }
+	Task* get_task() const { return task; } // NULL once closed
+	void unwatch();
+protected:
+	virtual void task_closed() {} // on closing, after being cleared
+private:
+	friend class Task;
+	Task* task;
+	TaskRef* prev;
+	TaskRef* next;
+};
+
+class Timer {
+	/* a callback at a time on the Scheduler's clock; see Scheduler::call_later() and call_every().
+	   Pending timers are kept in a binary heap, so arming and cancelling are O(log n) */
 public:
+	Timer(): scheduler(NULL), interval(0), slot(0) {}
+	virtual ~Timer(); // cancels
+	bool is_pending() const { return scheduler; }
+	void cancel();
+protected:
+	virtual void on_timer(const time64_t& now) = 0;
+private:
 	friend class Scheduler;
+	Scheduler* scheduler; // whilst pending
+	time64_t interval; // 0 unless repeating
+	size_t slot; // in the heap
+};
+
+class Deferred {
+	/* work for the Scheduler to do on its next loop iteration; see Scheduler::post().  Posting one
+	   that is already posted does nothing, so long work can re-post itself and go a slice at a time */
+public:
+	Deferred(): scheduler(NULL), next(NULL) {}
+	virtual ~Deferred(); // unposts
+	bool is_posted() const { return scheduler; }
+protected:
+	virtual void do_deferred() = 0;
+private:
+	friend class Scheduler;
+	Scheduler* scheduler; // whilst posted
+	Deferred* next;
+};
+
+class Task: public Closeable, protected Readable<Task>, protected Writeable<Task> {
+public:
+	friend class Scheduler;
+	friend class TaskRef;
+	friend class Readable<Task>;
+	friend class Writeable<Task>;
 	void construct();
 	virtual ~Task();
-	uint64_t gettid() const { return tid; }
+	uint32_t gettid() const { return tid; }
 	friend class Out;
 	virtual void dump_context(FILE* out) const;
 	uint32_t get_bytes_written() const { return totalWritten; }
@@ -79,92 +152,164 @@ public:
 	// allow per-task logging overrides; system logging controlled by error.hpp Log()/SetLog()
 	bool Log(LogLevel level);
 	void SetLog(LogLevel level,bool enable);
-	void setReadAheadBufferSize(uint16_t size);
-	void setWriteBufferSize(uint16_t size);
+	void setReadAheadBufferSize(uint16_t size); // allocated when needed, and given back when drained
+	void setWriteBufferSize(uint16_t size); // ditto
+	/* once more than high bytes are queued waiting for the peer to read them, the task stops reading
+	   until the queue drops to low; 0 (the default) never stops */
+	void setWriteWatermarks(uint32_t high,uint32_t low);
+	uint32_t get_bytes_queued() const { return queued; }
+	uint32_t get_queue_length() const { return out_length; }
+	bool is_congested() const { return congested; } // over the high watermark and not yet down to the low
+	const IPAddress& get_peer() const { return peer; } // if accepted from an IP Listener
 protected:
 	Task(Scheduler& scheduler,Task* parent = NULL);
 	void set_nonblocking();
 	static void set_nonblocking(int fd);
 	void set_nodelay(bool enabled);
 	static void set_nodelay(int fd,bool enabled);
+	static bool set_busy_poll(FD fd,uint32_t microsecs,bool prefer); // false if the kernel won't allow it
 	void set_cloexec();
 	static void set_cloexec(FD fd);
 	FD getfd() const { return fd; }
 	void close_fd();
 	bool is_end_of_input_stream() const { return eoinput; }
+	void graceful_close(const char* reason = NULL); // delivers any queued output before closing; doesn't throw
 	void set_read_timeout(uint32_t millisecs); // 0 to clear
 	void set_write_timeout(uint32_t millisecs); 
+	void set_deadline(const time64_t& due); // on the scheduler's clock; unlike the read timeout, reading doesn't move it.  0 to clear
 	virtual void handle_timeout(const time64_t& now);
-	void schedule(uint32_t flags);
+	void set_idle(bool idle); // between requests, so the first to be reaped when the scheduler is over its idle limits
+	void yield(); // stop reading for now, and have read() called again on the next loop iteration
+	bool next_request(); // from read(): counts a request against the slice's budget; false, having yielded, when spent
+	void defer_input(); // from read(): leave input unread; edge-triggered epoll won't say it's there, so come back to it
+	void schedule(uint32_t flags); // adds to what the task is woken for
 	void unschedule(uint32_t flags);
+	void watch(TaskRef& ref); // until the ref is unwatched or this closes
+	void offload(WorkerPool& pool,Job* job); // the job is done() back on this thread, if this is still open
 	// implementing Readable
+	IoStatus try_read(void* ptr,ssize_t bytes,ssize_t& read);
+	IoStatus try_read_str(char *s,size_t& len,size_t max);
+	template<class InLine> IoStatus try_read_in(InLine& in,size_t max = InLine::max);
+	IoStatus try_read(ResizeableBuffer& in,ssize_t& read,ssize_t max = 0);
+	IoStatus try_read_buffered(uint8_t*& ptr,uint16_t& len,uint16_t max = ~0);
+	uint16_t get_read_ahead() const { return read_ahead_len-read_ahead_ofs; } // read from the socket, and not yet taken
+	/* moves up to max bytes from the socket into pipe without copying them into user space; what is
+	   read ahead must be taken first.  EAGAIN can't tell an empty socket from a full pipe, so the
+	   pipe must have room */
+	IoStatus try_splice_in(FD pipe,size_t max,size_t& spliced);
 	bool async_read(void* ptr,ssize_t bytes,ssize_t& read);
 	bool async_read_str(char *s,size_t& len,size_t max);
-	using Readable::async_read_str;
+	using Readable<Task>::async_read_str;
 	template<class InLine> bool async_read_in(InLine& in,size_t max = InLine::max);
 	bool async_read(ResizeableBuffer& in,ssize_t& read,ssize_t max = 0);
 	uint16_t async_read_buffered(uint8_t*& ptr,uint16_t max = ~0);
 	// implementing Writeable
+	IoStatus try_write_cpy(const void* ptr,size_t len);
 	void async_write(const void* ptr,size_t len);
 	void async_write(Out* out) /* releases when sent */;
 	void async_write(const char* s);
 	void async_printf(const char* fmt,...);
+	template<typename... Args> void async_format(const Args&... args); // typed, straight into the write buffer; see format.hpp
 	void async_vprintf(const char* fmt,va_list ap);
 	void async_write_cpy(const void* ptr,size_t len);
 	void async_write_buffered(); // flushes anything buffered
+	IoStatus try_write_buffered();
 private: // to be implemented/overriden by subclasses
 	virtual void read() = 0;
 	virtual void disconnected();
+	virtual void drained() {} // all queued output has been sent
+	virtual void on_writable() {} // the queue has dropped to the low watermark, and reading has resumed
 	virtual void do_construct() = 0;
+private:
+	static uint32_t nexttid();
+	void run(uint32_t flags);
+	IoStatus do_async_write(const void* ptr,size_t len,size_t& written);
+	IoStatus do_async_writev(iovec* iov,int iovcnt,size_t& written);
+	IoStatus flush_out();
+	void enqueue(Out* o); // what couldn't be written now; after anything already queued
+	template<typename... Pieces> void async_format_pieces(const Pieces&... pieces);
+	char* reserve_write(size_t len); // room in the write buffer, or NULL if it can't take len
+	void enqueue_copy(const void* ptr,size_t len); // into the spare room of the last queued if it fits
+	void count_queued(size_t len);
+	bool alloc_read_ahead_buffer();
+	bool alloc_write_buffer();
+	void update_interest();
+	void release_idle_buffers();
+	struct Cold;
+	Cold& get_cold();
+	/* the fields touched on every event are kept together at the front so that, with the vptr,
+	   they fill the first cache line; everything after is touched when timeouts, links or logging change */
 protected:
 	FD fd;
+private:
+	uint32_t events; // what the task wants to be woken for
+protected:
 	Scheduler& scheduler;
 	Out* out;
-	const char* half_close;
 private:
-	static uint64_t nexttid();
-	void run(uint32_t flags);
-	bool do_async_write(const void* ptr,size_t len,size_t& written);
+	uint8_t* read_ahead_buffer;
+	uint16_t read_ahead_ofs, read_ahead_len, read_ahead_maxlen;
+	bool del_ok: 1;
+	bool closed: 1;
+	bool eoinput: 1;
+	bool sated: 1;
+	bool ready: 1; // on the scheduler's ready list
+	bool congested: 1;
+	bool input_paused: 1; // EPOLLIN unscheduled because congested
+	bool tail_copy: 1; // out_tail is an OutCopy that later small writes can be appended to
+	bool accepted: 1; // from a Listener, so counted in the scheduler's connections
+	bool idle: 1; // on the scheduler's idle list
+	uint8_t registered: 3; // the EPOLLIN|EPOLLOUT epoll has; see update_interest()
+	uint8_t* write_buffer;
+	uint16_t write_buffer_len, write_buffer_maxlen;
+	uint32_t totalRead;
+	// end of the first cache line
+	uint32_t totalWritten;
+	const uint32_t tid;
+	Out* out_tail;
+	uint32_t out_length; // Outs in out
+	uint32_t queued; // bytes in out
+	uint32_t high_water, low_water;
+protected:
+	const char* half_close;
 private:
-	unsigned log, logMask;
-	const uint64_t tid;
-	epoll_event event;
+	IPAddress peer;
 	Task* next_close;
-	bool del_ok;
-	bool closed;
-	bool eoinput;
-	bool sated;
-	uint32_t totalWritten;
-	uint32_t totalRead;
 	struct Link {
 		Link();
 		Task* prev;
 		Task* next;
-	} link;
-	Task* tree_parent;
-	Task* tree_first_child;
-	Task* tree_next_sibling;
-	struct Timeout: public Link {
-		Timeout();
-		time64_t due;
-		struct Data {
-			time64_t due;
-			time64_t timeout;
-		} read, write;
+	} link, idle_link;
+	struct Timeout: public Timer {
+		Timeout(Task& task);
+		void on_timer(const time64_t& now);
+		time64_t get_due() const; // the soonest of read, write and the deadline, or 0
+		Task& task;
+		time64_t read_due, write_due, deadline; // 0 if not set
+		uint32_t read_millisecs, write_millisecs;
 	} timeout;
-	uint8_t* read_ahead_buffer;
-	uint16_t read_ahead_ofs, read_ahead_len, read_ahead_maxlen;
-	uint8_t* write_buffer;
-	uint16_t write_buffer_len, write_buffer_maxlen;
+	Cold* cold; // logging overrides and the task tree; most tasks have neither
 private:
-	void set_timeout(Timeout::Data& to,Timeout::Data& other,uint32_t millisecs);
-	void unlink_timeout();
-	void sort_timeout();
+	void update_timeout();
 };
 
-class Tick {
+class BufferPool {
+	/* keeps released buffers of the few sizes tasks use, so idle tasks can give theirs back cheaply */
 public:
-	virtual time64_t tick(const time64_t& now) /* return time of scheduled next tick */ = 0;
+	BufferPool();
+	~BufferPool();
+	void* alloc(size_t size);
+	void release(void* buf,size_t size);
+	size_t get_bytes_in_use() const { return in_use; } // handed out and not yet released
+private:
+	enum { MAX_CLASSES = 8, MAX_FREE = 256 };
+	struct Class {
+		size_t size;
+		unsigned count;
+		void* free; // the first word of a free buffer points at the next
+	} classes[MAX_CLASSES];
+	Class* get_class(size_t size);
+	size_t in_use;
 };
 
 class Scheduler: public ErrorContext {
@@ -174,27 +319,171 @@ public:
 	void run();
 	bool is_shutting_down() const { return shutting_down; }
 	FD getfd() const { return epoll_fd; }
+	// the clock is read once per wakeup; the wall clock and Date string are refreshed as its second changes
 	time64_t get_now() const { return now; }
-	void enable_timeouts(bool enabled);
+	time_t get_wall_time() const { return wall_time; }
+	const char* get_http_date() const { return http_date; }
+	void set_time_source(TimeSource time_source); // time64_now() by default
+	void update_clock();
+	void enable_timeouts(bool enabled); // task read and write timeouts; other timers still run
+	/* fairness: rather than letting a task read until its socket is drained, a task that has read
+	   bytes or started requests beyond these budgets in one slice is put back on the ready list */
+	void set_slice_budget(uint32_t bytes,uint16_t requests); // 0 for unlimited, the default
+	void set_shuffle(bool enabled); // dispatch each batch of events in a random order
+	/* latency: rather than sleeping in epoll_wait as soon as there is nothing to do, spin polling it
+	   for up to microsecs first, so a request on a quiet connection doesn't wait for a wakeup.
+	   It burns a core whilst idle, so 0 (never spin) is the default */
+	void set_busy_poll(uint32_t microsecs);
+	void set_socket_busy_poll(uint32_t microsecs,bool prefer); // SO_BUSY_POLL (and SO_PREFER_BUSY_POLL) on accepted sockets
+	uint32_t get_socket_busy_poll() const { return socket_busy_poll; }
+	bool get_socket_prefer_busy_poll() const { return socket_prefer_busy_poll; }
+	/* admission control: at max_connections, Listeners stop accepting and leave connections in
+	   the kernel's backlog; with max_requests in flight, or whilst the loop is getting to events
+	   more than max_lag_millisecs after they arrived, new requests are shed (turned away without
+	   being handled) rather than slowing everyone down.  0 is unlimited, the default */
+	void set_admission_limits(uint32_t max_connections,uint32_t max_requests,uint32_t max_lag_millisecs);
+	bool at_connection_limit() const { return max_connections && (load_stats.connections >= max_connections); }
+	bool admit_request(); // counts it as in flight, or counts it as shed and returns false
+	void end_request();
+	struct LoadStats {
+		uint32_t connections; // accepted by Listeners and not yet closed
+		uint32_t requests; // in flight
+		time64_t lag; // how long the last loop iteration spent dispatching, which is how long events that came in during it waited
+		time64_t max_lag;
+		uint64_t shed; // requests turned away
+		uint64_t accept_pauses; // times Listeners stopped accepting at the connection limit
+		uint64_t deadlines; // tasks closed for missing their deadline
+		uint64_t reaped; // idle tasks closed to make room
+	};
+	const LoadStats& get_load_stats() const { return load_stats; }
+	/* idle reaping: tasks waiting between requests (see Task::set_idle()) are kept in the order
+	   they went idle, and whilst more than max_connections are open the oldest are closed to make
+	   room; whilst the buffer pool has more than max_buffer_bytes out, up to REAP_BATCH of them are
+	   closed each loop iteration.  0 for no limit, the default */
+	void set_idle_reaping(uint32_t max_connections,size_t max_buffer_bytes);
+	/* rate limits per client address (see RateLimiter), which aren't owned: Listeners close
+	   connections over theirs as they accept them, and HTTP connections hold requests over theirs
+	   for up to max_delay_millisecs, or turn them away with a 429 if that isn't long enough.
+	   NULL for none, the default */
+	void set_rate_limits(RateLimiter* connections,RateLimiter* requests,uint32_t max_delay_millisecs);
+	RateLimiter* get_connection_rate_limit() const { return connection_rate_limit; }
+	RateLimiter* get_request_rate_limit() const { return request_rate_limit; }
+	time64_t get_rate_limit_max_delay() const { return rate_limit_max_delay; }
+	// deferred work and timers
+	void post(Deferred* deferred); // run on the next loop iteration
+	void unpost(Deferred* deferred);
+	void call_later(Timer* timer,uint32_t millisecs); // rearms it if already pending
+	void call_every(Timer* timer,uint32_t millisecs);
+	void cancel(Timer* timer);
 	void dump_context(FILE* out) const;
 	const Task* get_current_task() const { return current_task; }
+	BufferPool& get_buffers() { return buffers; }
+	Mailbox& get_mailbox(); // created when first needed
+	struct OutStats {
+		uint64_t queued; // writes that had to wait for the socket
+		uint64_t coalesced; // of those, appended to the last queued rather than needing an Out of their own
+		uint64_t nodes; // Outs queued
+		uint32_t max_length; // the longest any task's queue has been
+	};
+	const OutStats& get_out_stats() const { return out_stats; }
+	struct PollStats {
+		uint64_t waits; // epoll_waits that returned events
+		uint64_t sleeps; // of all the epoll_waits, those that could block
+		uint64_t spins; // busy polls, and of those
+		uint64_t spin_hits; // the ones that found events before the budget ran out
+		int max_events; // the events array, which grows when a wait fills it and shrinks when it's mostly unused
+		uint64_t ctl_add, ctl_mod, ctl_del; // epoll_ctl calls
+		uint64_t filtered; // events for edge-triggered tasks that weren't waiting for them
+	};
+	PollStats get_poll_stats() const;
 	friend class Task;
+	friend class Mailbox;
+	friend class Listener;
 private:
-	const int max_events;
+	void dispatch(Task* task,uint32_t flags);
+	void make_ready(Task* task);
+	void run_ready();
+	void run_timers();
+	void set_timer(Timer* timer,time64_t due);
+	time64_t get_timer_due(const Timer* timer) const { return timers[timer->slot].due; }
+	void sift_up(size_t slot);
+	void sift_down(size_t slot);
+	int get_wait_timeout() const; // for epoll_wait, until the first timer
+	void fit_events(int nfds);
+	void connection_closed();
+	void reap_idle();
+	enum { REAP_BATCH = 16 };
+	enum { MIN_EVENTS = 64, MAX_EVENTS = 4096, SHRINK_WAITS = 1024 };
+	int max_events;
 	epoll_event* events;
+	int quiet_waits; // in a row that used under a quarter of the events array
 	const FD epoll_fd;
+	TimeSource time_source;
 	time64_t now;
+	time64_t next_wall_time;
+	time_t wall_time;
+	char http_date[HTTP_DATE_LEN+1];
 	Task* current_task;
-	Tick* tick;
 	Task* close_list;
 	Task* tasks;
-	Task* timeouts;
+	struct TimerSlot {
+		time64_t due; // kept here rather than in the Timer so sifting doesn't chase pointers
+		Timer* timer;
+	};
+	std::vector<TimerSlot> timers; // a binary min-heap on due
+	std::vector<Task*> ready; // tasks to read() on the next iteration; NULLed if deleted first
+	Deferred* posted; // FIFO
+	Deferred** posted_tail;
 	bool timeouts_enabled;
+	uint32_t read_budget, slice_read_end; // slice_read_end is compared to the running task's totalRead
+	uint16_t request_budget, slice_requests;
+	bool shuffle;
+	uint32_t shuffle_seed;
 	bool shutting_down;
+	BufferPool buffers;
+	Mailbox* mailbox;
+	OutStats out_stats;
+	PollStats poll_stats;
+	time64_t busy_poll;
+	uint32_t socket_busy_poll;
+	bool socket_prefer_busy_poll;
+	uint32_t max_connections, max_requests;
+	time64_t max_lag;
+	LoadStats load_stats;
+	std::vector<Task*> limited; // Listeners waiting for connections to drop below max_connections
+	Task* idle_head; // the longest idle
+	Task* idle_tail;
+	uint32_t reap_connections;
+	size_t reap_buffer_bytes;
+	RateLimiter* connection_rate_limit;
+	RateLimiter* request_rate_limit;
+	time64_t rate_limit_max_delay;
+	FD prepared_fd; // being handed to a Listener's factory, already non-blocking and close-on-exec
+	IPAddress prepared_peer; // and where it's from
 };
 
+template<typename... Args> void Task::async_format(const Args&... args) {
+	async_format_pieces(fmt::piece(args)...);
+}
+
+template<typename... Pieces> void Task::async_format_pieces(const Pieces&... pieces) {
+	const size_t max = fmt::max_length(pieces...);
+	if(char* dest = reserve_write(max)) {
+		write_buffer_len += (fmt::render_all(dest,pieces...) - dest);
+		return;
+	}
+	char* buf = reinterpret_cast<char*>(malloc(max));
+	if(!buf)
+		ThrowInternalError("out of memory");
+	async_write(new OutFree(buf,fmt::render_all(buf,pieces...) - buf));
+}
+
+template<class InLine> IoStatus Task::try_read_in(InLine& in,size_t max) {
+	return try_read_str(in.bufz,in.len,std::min<size_t>(max,InLine::max));
+}
+
 template<class InLine> bool Task::async_read_in(InLine& in,size_t max) {
-	return async_read_str(in.bufz,in.len,std::min<size_t>(max,sizeof(in.bufz)));
+	return async_read_str(in.bufz,in.len,std::min<size_t>(max,InLine::max));
 }
 
 #endif //TASK_HPP
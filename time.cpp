@@ -4,11 +4,9 @@
 #include "time.hpp"
 #include "error.hpp"
 
-#ifdef TIME_NANO
-	#include <time.h>
-#else
-	#include <sys/time.h>
-#endif
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
 
 int time64_to_millisecs(const time64_t& time) {
 	return time64_to_millisecs64(time);
@@ -30,18 +28,46 @@ time64_t millisecs_to_time64(int millisecs) {
 #endif
 }
 
-time64_t time64_now() {
-	time64_t ret;
+time64_t microsecs_to_time64(int64_t microsecs) {
 #ifdef TIME_NANO
-	timespec ts;
-	check(clock_gettime(CLOCK_MONOTONIC,&ts));
-	ret = (ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+	return (microsecs*1000LL);
+#else
+	return microsecs;
+#endif
+}
+
+static time64_t timespec_to_time64(const timespec& ts) {
+#ifdef TIME_NANO
+	return (ts.tv_sec * 1000000000LL) + ts.tv_nsec;
 #else
-	timeval tv;
-	check(gettimeofday(&tv,NULL));
-	ret = (tv.tv_sec * 1000000LL) + tv.tv_usec;
+	return (ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000);
 #endif
-	return ret;
 }
 
+time64_t time64_now() {
+	timespec ts;
+	check(clock_gettime(CLOCK_MONOTONIC,&ts));
+	return timespec_to_time64(ts);
+}
+
+time64_t time64_now_coarse() {
+	timespec ts;
+	check(clock_gettime(CLOCK_MONOTONIC_COARSE,&ts));
+	return timespec_to_time64(ts);
+}
+
+void format_http_date(time_t t,char buf[HTTP_DATE_LEN+1]) {
+	static const char* const days[] = {"Sun","Mon","Tue","Wed","Thu","Fri","Sat"};
+	static const char* const months[] = {"Jan","Feb","Mar","Apr","May","Jun","Jul","Aug","Sep","Oct","Nov","Dec"};
+	tm gmt;
+	gmtime_r(&t,&gmt);
+	// rendered where any ints fit, as the compiler can't know gmtime's are in range, then copied out
+	char full[96];
+	const int len = snprintf(full,sizeof(full),"%s, %02d %s %04d %02d:%02d:%02d GMT",
+		days[gmt.tm_wday],gmt.tm_mday,months[gmt.tm_mon],gmt.tm_year+1900,
+		gmt.tm_hour,gmt.tm_min,gmt.tm_sec);
+	const size_t copy = (0 < len)? std::min<size_t>(len,HTTP_DATE_LEN): 0;
+	memcpy(buf,full,copy);
+	buf[copy] = '\0';
+}
 
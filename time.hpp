@@ -5,7 +5,10 @@
 #define TIME_HPP
 
 #include <stdint.h>
+#include <time.h>
 
+/* a time64_t is microseconds (nanoseconds if TIME_NANO) on the monotonic clock, so NTP and
+   other steps of the wall clock don't move timeouts; wall-clock time is only for display */
 typedef int64_t time64_t;
 
 int time64_to_millisecs(const time64_t& time);
@@ -14,7 +17,17 @@ uint64_t time64_to_millisecs64(const time64_t& time);
 
 time64_t millisecs_to_time64(int millisecs);
 
-time64_t time64_now();
+time64_t microsecs_to_time64(int64_t microsecs);
+
+time64_t time64_now(); // CLOCK_MONOTONIC
+
+time64_t time64_now_coarse(); // CLOCK_MONOTONIC_COARSE; much cheaper, but only as precise as the kernel tick
+
+typedef time64_t (*TimeSource)();
+
+enum { HTTP_DATE_LEN = 29 };
+
+void format_http_date(time_t t,char buf[HTTP_DATE_LEN+1]); // e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
 
 #endif //TIME_HPP
 
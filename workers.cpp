@@ -0,0 +1,137 @@
+/* (c) William Edwards, 2011
+   Using the Simplified BSD License.  See LICENSE file for details */
+
+#include "workers.hpp"
+
+void Job::deliver(Scheduler& scheduler) {
+	if(!get_task()) // closed meanwhile
+		return;
+	unwatch();
+	done();
+}
+
+void Job::task_closed() {
+	cancelled.store(true,std::memory_order_relaxed);
+}
+
+WorkerPool::WorkerPool(unsigned threads): next_worker(0), queued(0), stopping(false) {
+	if(!threads)
+		ThrowInternalError("a WorkerPool needs threads");
+	check(-pthread_mutex_init(&idle_lock,NULL));
+	check(-pthread_cond_init(&idle,NULL));
+	for(unsigned i=0; i<threads; i++) {
+		Worker* worker = new Worker();
+		worker->pool = this;
+		worker->run = worker->stolen = worker->cancelled = 0;
+		check(-pthread_mutex_init(&worker->lock,NULL));
+		workers.push_back(worker);
+	}
+	for(size_t i=0; i<workers.size(); i++)
+		check(-pthread_create(&workers[i]->thread,NULL,main,workers[i]));
+}
+
+WorkerPool::~WorkerPool() {
+	pthread_mutex_lock(&idle_lock);
+	stopping = true;
+	pthread_cond_broadcast(&idle);
+	pthread_mutex_unlock(&idle_lock);
+	for(size_t i=0; i<workers.size(); i++) {
+		pthread_join(workers[i]->thread,NULL);
+		pthread_mutex_destroy(&workers[i]->lock);
+		delete workers[i];
+	}
+	pthread_cond_destroy(&idle);
+	pthread_mutex_destroy(&idle_lock);
+}
+
+void WorkerPool::submit(Job* job,Mailbox& reply_to) {
+	job->reply_to = &reply_to;
+	// counted before it is queued, so it can't be taken and uncounted first
+	queued.fetch_add(1,std::memory_order_relaxed);
+	Worker& worker = *workers[next_worker.fetch_add(1,std::memory_order_relaxed) % workers.size()];
+	pthread_mutex_lock(&worker.lock);
+	worker.queue.push_back(job);
+	pthread_mutex_unlock(&worker.lock);
+	// taking the idle lock orders this against a worker deciding to sleep
+	pthread_mutex_lock(&idle_lock);
+	pthread_cond_signal(&idle);
+	pthread_mutex_unlock(&idle_lock);
+}
+
+Job* WorkerPool::next_job(Worker& worker) {
+	Job* job = NULL;
+	pthread_mutex_lock(&worker.lock);
+	if(!worker.queue.empty()) {
+		job = worker.queue.front();
+		worker.queue.pop_front();
+	}
+	pthread_mutex_unlock(&worker.lock);
+	if(job)
+		return job;
+	// steal, starting after ourselves so thieves don't all pick on the first
+	const size_t count = workers.size();
+	size_t self = 0;
+	while(workers[self] != &worker)
+		self++;
+	for(size_t i=1; (i<count) && !job; i++) {
+		Worker& victim = *workers[(self+i)%count];
+		pthread_mutex_lock(&victim.lock);
+		if(!victim.queue.empty()) {
+			job = victim.queue.back();
+			victim.queue.pop_back();
+		}
+		pthread_mutex_unlock(&victim.lock);
+	}
+	if(job)
+		worker.stolen.fetch_add(1,std::memory_order_relaxed);
+	return job;
+}
+
+void WorkerPool::run_job(Worker& worker,Job* job) {
+	queued.fetch_sub(1,std::memory_order_relaxed);
+	if(job->is_cancelled())
+		worker.cancelled.fetch_add(1,std::memory_order_relaxed);
+	else {
+		try {
+			job->run();
+		} catch(Error* e) { // it is still sent back, so it can be released on its own thread
+			e->dump();
+			e->release();
+		} catch(...) {
+			fprintf(stderr,"unexpected exception in job!\n");
+		}
+		worker.run.fetch_add(1,std::memory_order_relaxed);
+	}
+	job->reply_to->send(job);
+}
+
+void* WorkerPool::main(void* w) {
+	Worker& worker = *reinterpret_cast<Worker*>(w);
+	WorkerPool& pool = *worker.pool;
+	for(;;) {
+		if(Job* job = pool.next_job(worker)) {
+			pool.run_job(worker,job);
+			continue;
+		}
+		pthread_mutex_lock(&pool.idle_lock);
+		while(!pool.queued.load(std::memory_order_relaxed) && !pool.stopping)
+			pthread_cond_wait(&pool.idle,&pool.idle_lock);
+		const bool done = (pool.stopping && !pool.queued.load(std::memory_order_relaxed));
+		pthread_mutex_unlock(&pool.idle_lock);
+		if(done)
+			return NULL;
+	}
+}
+
+void WorkerPool::get_stats(std::vector<Stats>& stats) const {
+	stats.resize(workers.size());
+	for(size_t i=0; i<workers.size(); i++) {
+		const Worker& worker = *workers[i];
+		pthread_mutex_lock(&worker.lock);
+		stats[i].queued = worker.queue.size();
+		pthread_mutex_unlock(&worker.lock);
+		stats[i].run = worker.run.load(std::memory_order_relaxed);
+		stats[i].stolen = worker.stolen.load(std::memory_order_relaxed);
+		stats[i].cancelled = worker.cancelled.load(std::memory_order_relaxed);
+	}
+}
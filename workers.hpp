@@ -0,0 +1,66 @@
+/* (c) William Edwards, 2011
+   Using the Simplified BSD License.  See LICENSE file for details */
+
+#ifndef WORKERS_HPP
+#define WORKERS_HPP
+
+#include "mailbox.hpp"
+
+#include <pthread.h>
+#include <atomic>
+#include <deque>
+#include <vector>
+
+class Job: public Message, private TaskRef {
+	/* work too slow or blocking for a scheduler thread, handed to a WorkerPool with Task::offload().
+	   run() happens on a worker thread, then done() back on the task's scheduler thread; if the task
+	   closes first the job is cancelled, and done() is never called */
+public:
+	Job(): cancelled(false) {}
+	bool is_cancelled() const { return cancelled.load(std::memory_order_relaxed); } // thread-safe
+protected:
+	virtual void run() = 0; // on a worker thread; mustn't touch the task or its scheduler
+	virtual void done() = 0; // on the task's scheduler thread
+private:
+	friend class Task;
+	friend class WorkerPool;
+	void deliver(Scheduler& scheduler);
+	void task_closed();
+	Mailbox* reply_to;
+	std::atomic<bool> cancelled;
+};
+
+class WorkerPool {
+	/* threads that run Jobs.  Each worker has its own queue and submissions are spread over them
+	   round-robin; a worker whose queue is empty steals from the back of the others' */
+public:
+	explicit WorkerPool(unsigned threads);
+	~WorkerPool(); // waits for queued jobs to be run or cancelled
+	void submit(Job* job,Mailbox& reply_to); // any thread; see Task::offload()
+	struct Stats {
+		size_t queued;
+		uint64_t run;
+		uint64_t stolen; // run by this worker, from another's queue
+		uint64_t cancelled;
+	};
+	void get_stats(std::vector<Stats>& stats) const; // one per worker
+private:
+	struct Worker {
+		WorkerPool* pool;
+		pthread_t thread;
+		mutable pthread_mutex_t lock;
+		std::deque<Job*> queue;
+		std::atomic<uint64_t> run, stolen, cancelled;
+	};
+	static void* main(void* worker);
+	Job* next_job(Worker& worker);
+	void run_job(Worker& worker,Job* job);
+	std::vector<Worker*> workers;
+	std::atomic<unsigned> next_worker;
+	std::atomic<size_t> queued;
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle;
+	bool stopping;
+};
+
+#endif //WORKERS_HPP